@@ -0,0 +1,330 @@
+/*
+ * Process many unix v6 filesystem images in parallel.
+ *
+ * Copyright (C) 2006 Serge Vakulenko, <vak@cronyx.ru>
+ *
+ * This file is part of BKUNIX project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "u6fs.h"
+
+extern int verbose;
+
+typedef struct {
+	char		**images;	/* names of image files */
+	int		nimages;
+	int		next;		/* next image to process */
+	int		failed;		/* number of images with errors */
+	int		op;		/* U6FS_BATCH_xxx */
+	int		fix;		/* repair on check */
+	int		fast;		/* skip check of unchanged images */
+	int		flat;		/* no sector remapping */
+	FILE		*out;		/* where to write records */
+	pthread_mutex_t	lock;
+} batch_t;
+
+static double now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Print a string as JSON literal.
+ */
+void u6fs_json_string (FILE *out, const char *s, size_t len)
+{
+	putc ('"', out);
+	for (; len > 0; s++, len--) {
+		switch (*s) {
+		case '"':  fputs ("\\\"", out); break;
+		case '\\': fputs ("\\\\", out); break;
+		case '\n': fputs ("\\n", out);  break;
+		case '\t': fputs ("\\t", out);  break;
+		default:
+			if ((unsigned char) *s < ' ')
+				fprintf (out, "\\u%04x", *s);
+			else
+				putc (*s, out);
+		}
+	}
+	putc ('"', out);
+}
+
+/*
+ * Check the image. Checker messages are included
+ * in the record only when problems are found.
+ */
+static int batch_check (batch_t *b, u6fs_t *fs, FILE *out)
+{
+	u6fs_check_t *ck;
+	char *log = 0;
+	size_t loglen = 0;
+	FILE *logf;
+	int i, ok;
+
+	ck = malloc (sizeof (*ck));
+	logf = open_memstream (&log, &loglen);
+	if (! ck || ! logf) {
+		fprintf (out, ",\"status\":\"failed\",\"error\":\"no memory\"");
+		if (ck)
+			free (ck);
+		if (logf)
+			fclose (logf);
+		return 0;
+	}
+	u6fs_check_init (ck, fs, logf);
+	ck->fast = b->fast;
+	ok = u6fs_check (ck);
+	fclose (logf);
+
+	fprintf (out, ",\"status\":\"%s\",\"errors\":%u",
+		! ok ? "failed" : ck->errors ? "errors" : "ok", ck->errors);
+	fprintf (out, ",\"files\":%u,\"used\":%u,\"free\":%u,\"modified\":%s",
+		ck->total_files, ck->used_blocks, ck->free_blocks,
+		fs->modified ? "true" : "false");
+	if (ck->skipped)
+		fprintf (out, ",\"skipped\":true");
+	fprintf (out, ",\"reads\":%lu,\"writes\":%lu",
+		fs->io.reads, fs->io.writes);
+	fprintf (out, ",\"phases\":{");
+	for (i = 0; i < U6FS_CHECK_PHASES; i++)
+		fprintf (out, "%s\"%s\":%.6f", i ? "," : "",
+			u6fs_check_phase_name (i), ck->phase_time[i]);
+	fprintf (out, "},\"phase_errors\":{");
+	for (i = 0; i < U6FS_CHECK_PHASES; i++)
+		fprintf (out, "%s\"%s\":%u", i ? "," : "",
+			u6fs_check_phase_name (i), ck->phase_errors[i]);
+	fprintf (out, "}");
+	if (! ok || ck->errors) {
+		fprintf (out, ",\"log\":");
+		u6fs_json_string (out, log, loglen);
+	}
+	ok = ok && ck->errors == 0;
+	free (log);
+	free (ck);
+	return ok;
+}
+
+static void batch_lister (u6fs_inode_t *dir, u6fs_inode_t *inode,
+	char *dirname, char *filename, void *arg)
+{
+	FILE *out = arg;
+	char *path;
+
+	path = alloca (strlen (dirname) + strlen (filename) + 2);
+	strcpy (path, dirname);
+	strcat (path, "/");
+	strcat (path, filename);
+
+	fprintf (out, "%s{\"path\":", ftell (out) > 0 ? "," : "");
+	u6fs_json_string (out, path, strlen (path));
+	fprintf (out, ",\"inode\":%u,\"mode\":\"%o\",\"nlink\":%u,"
+		"\"uid\":%u,\"gid\":%u,\"size\":%u,\"mtime\":%u}",
+		inode->number, inode->mode, inode->nlink, inode->uid,
+		inode->gid, inode->size, inode->mtime);
+
+	if ((inode->mode & INODE_MODE_FMT) == INODE_MODE_FDIR)
+		u6fs_directory_scan (inode, path, batch_lister, arg);
+}
+
+/*
+ * List all files of the image.
+ */
+static int batch_list (u6fs_t *fs, FILE *out)
+{
+	u6fs_inode_t root;
+	char *list = 0;
+	size_t len = 0;
+	FILE *lf;
+
+	if (! u6fs_inode_get (fs, &root, LSXFS_ROOT_INODE)) {
+		fprintf (out, ",\"status\":\"failed\","
+			"\"error\":\"cannot get root inode\"");
+		return 0;
+	}
+	lf = open_memstream (&list, &len);
+	if (! lf) {
+		fprintf (out, ",\"status\":\"failed\",\"error\":\"no memory\"");
+		return 0;
+	}
+	u6fs_directory_scan (&root, "", batch_lister, lf);
+	fclose (lf);
+	fprintf (out, ",\"status\":\"ok\",\"files\":[%s]", list);
+	free (list);
+	return 1;
+}
+
+/*
+ * Print the superblock.
+ */
+static int batch_summary (u6fs_t *fs, FILE *out)
+{
+	fprintf (out, ",\"status\":\"ok\",\"fsize\":%u,\"isize\":%u,"
+		"\"nfree\":%u,\"ninode\":%u,\"updated\":%u",
+		fs->fsize, fs->isize, fs->nfree, fs->ninode, fs->time);
+	return 1;
+}
+
+static void batch_counts (FILE *out, const char *name,
+	u6fs_usage_count_t *count)
+{
+	int i, n = 0;
+
+	fprintf (out, ",\"%s\":{", name);
+	for (i = 0; i < 256; i++)
+		if (count[i].files)
+			fprintf (out, "%s\"%d\":{\"files\":%u,\"blocks\":%u}",
+				n++ ? "," : "", i, count[i].files,
+				count[i].blocks);
+	fprintf (out, "}");
+}
+
+/*
+ * Print the space use, without directory subtrees.
+ */
+static int batch_usage (u6fs_t *fs, FILE *out)
+{
+	u6fs_usage_t u;
+
+	if (! u6fs_usage_build (&u, fs, 0)) {
+		fprintf (out, ",\"status\":\"failed\","
+			"\"error\":\"cannot compute usage\"");
+		return 0;
+	}
+	fprintf (out, ",\"status\":\"ok\",\"fsize\":%u,\"isize\":%u,"
+		"\"used\":%u,\"data\":%u,\"indirect\":%u,\"free\":%u,"
+		"\"inodes\":%u,\"ninodes\":%u",
+		fs->fsize, fs->isize, u.data_blocks + u.ind_blocks,
+		u.data_blocks, u.ind_blocks, u.free_blocks, u.inodes,
+		u.ninodes);
+	batch_counts (out, "uid", u.uid);
+	batch_counts (out, "gid", u.gid);
+	u6fs_usage_free (&u);
+	return 1;
+}
+
+/*
+ * Process a single image, and write one line of output.
+ */
+static void batch_image (batch_t *b, char *name)
+{
+	static char *op_name[] = { "check", "list", "summary", "usage" };
+	u6fs_t fs;
+	char *rec = 0;
+	size_t len = 0;
+	FILE *out;
+	double start = now ();
+	int ok = 0;
+
+	out = open_memstream (&rec, &len);
+	if (! out)
+		return;
+	fprintf (out, "{\"image\":");
+	u6fs_json_string (out, name, strlen (name));
+	fprintf (out, ",\"op\":\"%s\"", op_name [b->op]);
+
+	if (! u6fs_open (&fs, name, b->op == U6FS_BATCH_CHECK && b->fix,
+	    b->flat)) {
+		fprintf (out, ",\"status\":\"failed\",\"error\":\"cannot open\"");
+	} else {
+		switch (b->op) {
+		case U6FS_BATCH_CHECK:
+			ok = batch_check (b, &fs, out);
+			break;
+		case U6FS_BATCH_LIST:
+			ok = batch_list (&fs, out);
+			break;
+		case U6FS_BATCH_SUMMARY:
+			ok = batch_summary (&fs, out);
+			break;
+		case U6FS_BATCH_USAGE:
+			ok = batch_usage (&fs, out);
+			break;
+		}
+		u6fs_close (&fs);
+	}
+	fprintf (out, ",\"time\":%.6f}\n", now () - start);
+	fclose (out);
+
+	pthread_mutex_lock (&b->lock);
+	fwrite (rec, 1, len, b->out);
+	fflush (b->out);
+	if (! ok)
+		b->failed++;
+	pthread_mutex_unlock (&b->lock);
+	free (rec);
+}
+
+static void *batch_worker (void *arg)
+{
+	batch_t *b = arg;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock (&b->lock);
+		i = b->next++;
+		pthread_mutex_unlock (&b->lock);
+		if (i >= b->nimages)
+			break;
+		batch_image (b, b->images [i]);
+	}
+	return 0;
+}
+
+/*
+ * Process the images by a pool of 'jobs' threads.
+ * Every thread handles one image at a time.
+ * Write one JSON record per image, as soon as it is done.
+ * Return the number of images which failed or have errors.
+ */
+int u6fs_batch (char **images, int nimages, int op, int jobs, int fix,
+	int fast, int flat, FILE *out)
+{
+	batch_t b;
+	pthread_t *threads;
+	int i;
+
+	memset (&b, 0, sizeof (b));
+	b.images = images;
+	b.nimages = nimages;
+	b.op = op;
+	b.fix = fix;
+	b.fast = fast;
+	b.flat = flat;
+	b.out = out;
+	pthread_mutex_init (&b.lock, 0);
+
+	if (jobs > nimages)
+		jobs = nimages;
+	if (jobs < 1)
+		jobs = 1;
+	threads = calloc (jobs, sizeof (*threads));
+	if (! threads)
+		jobs = 0;
+	for (i = 0; i < jobs; i++) {
+		if (pthread_create (&threads[i], 0, batch_worker, &b) != 0) {
+			fprintf (stderr, "batch: cannot create thread\n");
+			break;
+		}
+	}
+	jobs = i;
+	if (jobs == 0)
+		batch_worker (&b);
+	for (i = 0; i < jobs; i++)
+		pthread_join (threads[i], 0);
+	if (verbose)
+		fprintf (stderr, "batch: %d images, %d threads, %d failed\n",
+			nimages, jobs, b.failed);
+	free (threads);
+	pthread_mutex_destroy (&b.lock);
+	return b.failed;
+}
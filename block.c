@@ -8,6 +8,7 @@
  * See the accompanying file "COPYING" for more details.
  */
 #include <stdio.h>
+#include <string.h>
 #include "u6fs.h"
 
 extern int verbose;
@@ -17,6 +18,14 @@ int u6fs_read_block (u6fs_t *fs, unsigned short bnum, unsigned char *data)
 /*	printf ("read block %d\n", bnum);*/
 	if (bnum <= fs->isize + 1)
 		return 0;
+	if (fs->snapshot) {
+		unsigned char *cached = u6fs_snapshot_block (fs, bnum);
+
+		if (! cached)
+			return 0;
+		memcpy (data, cached, 512);
+		return 1;
+	}
 	if (! u6fs_seek (fs, bnum * 512L))
 		return 0;
 	if (! u6fs_read (fs, data, 512))
@@ -29,10 +38,15 @@ int u6fs_write_block (u6fs_t *fs, unsigned short bnum, unsigned char *data)
 /*	printf ("write block %d\n", bnum);*/
 	if (! fs->writable || bnum <= fs->isize + 1)
 		return 0;
-	if (! u6fs_seek (fs, bnum * 512L))
-		return 0;
-	if (! u6fs_write (fs, data, 512))
-		return 0;
+	if (fs->snapshot) {
+		if (! u6fs_snapshot_write (fs, bnum, data))
+			return 0;
+	} else {
+		if (! u6fs_seek (fs, bnum * 512L))
+			return 0;
+		if (! u6fs_write (fs, data, 512))
+			return 0;
+	}
 	fs->modified = 1;
 	return 1;
 }
@@ -46,7 +60,13 @@ int u6fs_block_free (u6fs_t *fs, unsigned int bno)
 	unsigned short buf [256];
 
 /*	printf ("free block %d, total %d\n", bno, fs->nfree);*/
+	if (fs->nfree == 0 && bno != 0) {
+		/* Empty list: start a new chain, ended by 0. */
+		fs->free [0] = 0;
+		fs->nfree = 1;
+	}
 	if (fs->nfree >= 100) {
+		memset (buf, 0, sizeof (buf));
 		buf[0] = lsb_short (fs->nfree);
 		for (i=0; i<100; i++)
 			buf[i+1] = lsb_short (fs->free[i]);
@@ -13,14 +13,15 @@
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "u6fs.h"
 
 extern int verbose;
 
 #define	MAXDUP		10	/* limit on dup blks (per inode) */
 #define	MAXBAD		10	/* limit on bad blks (per inode) */
-#define	DUP_LIST_SIZE	100	/* num of dup blocks to remember */
-#define LINK_LIST_SIZE	20	/* num zero link cnts to remember */
+#define	MAXFREEDUP	100	/* limit on dup blks in free list */
 
 #define STATE_BITS	2	/* bits per inode state */
 #define STATE_MASK	3	/* mask for inode state */
@@ -38,116 +39,213 @@ extern int verbose;
 #define SKIP		002
 #define STOP		001
 
-#define outrange(fs,x)	((x) < (fs)->isize + 2 || (x) >= (fs)->fsize)
-
-/* block scan function, called by scan_inode for every file block */
-typedef int scanner_t (u6fs_inode_t *inode, unsigned short blk, void *arg);
-
-static unsigned char	buf_data [LSXFS_BSIZE];	/* buffer data for scan_directory */
-static unsigned short	buf_bno;		/* buffer block number */
-static int		buf_dirty;		/* buffer data modified */
+#define ILIST_CHUNK	32	/* I list blocks read at once in phase 1 */
 
-static unsigned short	dup_list [DUP_LIST_SIZE]; /* dup block table */
-static unsigned short	*dup_end;		/* next entry in dup table */
-static unsigned short	*dup_multi;		/* multiple dups part of table */
+#define MAP_BITS	(8 * sizeof (unsigned long))	/* bits per map word */
+#define map_word(n)	((n) / MAP_BITS)
+#define map_bit(n)	(1UL << ((n) % MAP_BITS))
 
-static unsigned short	bad_link_list [LINK_LIST_SIZE]; /* inos with zero link cnts */
-static unsigned short	*bad_link_end;		/* next entry in table */
-
-static char		*block_map;		/* primary blk allocation map */
-static char		*free_map;		/* secondary blk allocation map */
-static char		*state_map;		/* inode state table */
-static short		*link_count;		/* link count table */
+#define outrange(fs,x)	((x) < (fs)->isize + 2 || (x) >= (fs)->fsize)
 
-static char		pathname [256];		/* file path name for pass2 */
-static char		*pathp;			/* pointer to pathname position */
-static char		*thisname;		/* ptr to current pathname component */
+/* block scan function, called by scan_inode for every file block */
+typedef int scanner_t (u6fs_check_t *ck, u6fs_inode_t *inode,
+	unsigned short blk, void *arg);
 
 static char		*lost_found_name = "lost+found";
-static unsigned short	lost_found_inode;	/* lost & found directory */
-
-static int		free_list_corrupted;	/* corrupted free list */
-static int		bad_blocks;		/* num of bad blks seen (per inode) */
-static int		dup_blocks;		/* num of dup blks seen (per inode) */
 
-static char		*find_inode_name;	/* searching for this name */
-static unsigned short	find_inode_result;	/* result of inode search */
-static unsigned short	lost_inode;		/* lost file to reconnect */
+static const char	*phase_name [U6FS_CHECK_PHASES] = {
+	"1", "1b", "2", "3", "4", "5", "6",
+};
 
-static unsigned int	scan_filesize;		/* file size, decremented during scan */
-static unsigned short	total_files;		/* number of files seen */
-
-static void set_inode_state (unsigned short inum, int s)
+static void set_inode_state (u6fs_check_t *ck, unsigned short inum, int s)
 {
 	unsigned int byte, shift;
 
 	byte = inum / STATES_PER_BYTE;
 	shift = inum % STATES_PER_BYTE * STATE_BITS;
-	state_map [byte] &= ~(STATE_MASK << shift);
-	state_map [byte] |= s << shift;
+	ck->state_map [byte] &= ~(STATE_MASK << shift);
+	ck->state_map [byte] |= s << shift;
 }
 
-static int inode_state (unsigned short inum)
+static int inode_state (u6fs_check_t *ck, unsigned short inum)
 {
 	unsigned int byte, shift;
 
 	byte = inum / STATES_PER_BYTE;
 	shift = inum % STATES_PER_BYTE * STATE_BITS;
-	return (state_map [byte] >> shift) & STATE_MASK;
+	return (ck->state_map [byte] >> shift) & STATE_MASK;
+}
+
+static int block_is_busy (u6fs_check_t *ck, unsigned short blk)
+{
+	return (ck->block_map [map_word (blk)] & map_bit (blk)) != 0;
+}
+
+static void mark_block_busy (u6fs_check_t *ck, unsigned short blk)
+{
+	ck->block_map [map_word (blk)] |= map_bit (blk);
+}
+
+static void mark_block_free (u6fs_check_t *ck, unsigned short blk)
+{
+	ck->block_map [map_word (blk)] &= ~map_bit (blk);
+}
+
+static void mark_free_list (u6fs_check_t *ck, unsigned short blk)
+{
+	ck->free_map [map_word (blk)] |= map_bit (blk);
+}
+
+static int in_free_list (u6fs_check_t *ck, unsigned short blk)
+{
+	return (ck->free_map [map_word (blk)] & map_bit (blk)) != 0;
+}
+
+/*
+ * Count set bits of the map in range from..to-1, a word at a time.
+ */
+static unsigned int map_count (unsigned long *map, unsigned int from,
+	unsigned int to)
+{
+	unsigned int i, count = 0;
+	unsigned long w;
+
+	for (i = map_word (from); i * MAP_BITS < to; i++) {
+		w = map [i];
+		if (i == map_word (from))
+			w &= ~(map_bit (from) - 1);
+		if ((i + 1) * MAP_BITS > to)
+			w &= map_bit (to) - 1;
+		count += __builtin_popcountl (w);
+	}
+	return count;
+}
+
+/*
+ * Find the first clear bit of the map in range from..to-1.
+ * Return 'to' when all bits are set.
+ */
+static unsigned int map_next_clear (unsigned long *map, unsigned int from,
+	unsigned int to)
+{
+	unsigned int i, n;
+	unsigned long w;
+
+	for (i = map_word (from); i * MAP_BITS < to; i++) {
+		w = ~map [i];
+		if (i == map_word (from))
+			w &= ~(map_bit (from) - 1);
+		if (w) {
+			n = i * MAP_BITS + __builtin_ctzl (w);
+			return n < to ? n : to;
+		}
+	}
+	return to;
+}
+
+static int is_dup_pending (u6fs_check_t *ck, unsigned short blk)
+{
+	return ck->dup_map [blk >> 3] & (1 << (blk & 7));
 }
 
-static int block_is_busy (unsigned short blk)
+static void mark_dup_pending (u6fs_check_t *ck, unsigned short blk)
 {
-	return block_map [blk >> 3] & (1 << (blk & 7));
+	ck->dup_map [blk >> 3] |= 1 << (blk & 7);
 }
 
-static void mark_block_busy (unsigned short blk)
+static void clear_dup_pending (u6fs_check_t *ck, unsigned short blk)
 {
-	block_map [blk >> 3] |= 1 << (blk & 7);
+	ck->dup_map [blk >> 3] &= ~(1 << (blk & 7));
 }
 
-static void mark_block_free (unsigned short blk)
+static int has_zero_link (u6fs_check_t *ck, unsigned short inum)
 {
-	block_map [blk >> 3] &= ~(1 << (blk & 7));
+	return ck->zero_link_map [inum >> 3] & (1 << (inum & 7));
 }
 
-static void mark_free_list (unsigned short blk)
+static void mark_zero_link (u6fs_check_t *ck, unsigned short inum)
 {
-	free_map [blk >> 3] |= 1 << (blk & 7);
+	ck->zero_link_map [inum >> 3] |= 1 << (inum & 7);
 }
 
-static int in_free_list (unsigned short blk)
+/*
+ * Find the path of the inode. Names of all inodes are
+ * collected at once, on first use, and shared by all findings.
+ * Return 0 when the inode is not reachable from the root.
+ */
+static char *inode_path (u6fs_check_t *ck, unsigned short inum,
+	char *buf, unsigned int size)
+{
+	if (! ck->pathmap) {
+		ck->pathmap = malloc (sizeof (*ck->pathmap));
+		if (! ck->pathmap)
+			return 0;
+		/* On failure, the map stays empty. */
+		u6fs_pathmap_build (ck->pathmap, ck->fs);
+	}
+	return u6fs_pathmap_name (ck->pathmap, inum, buf, size);
+}
+
+/*
+ * Count a problem. In JSON mode, also report it as a record
+ * with the inode, block and path, when known.
+ */
+static void finding (u6fs_check_t *ck, char *what, unsigned short inum,
+	unsigned short blk, char *path)
 {
-	return free_map [blk >> 3] & (1 << (blk & 7));
+	char buf [256];
+
+	ck->errors++;
+	if (ck->phase >= 0)
+		ck->phase_errors [ck->phase]++;
+	if (! ck->json)
+		return;
+	if (! path && inum)
+		path = inode_path (ck, inum, buf, sizeof (buf));
+	fprintf (ck->json, "{\"phase\":\"%s\",\"finding\":",
+		ck->phase >= 0 ? phase_name [ck->phase] : "");
+	u6fs_json_string (ck->json, what, strlen (what));
+	if (inum)
+		fprintf (ck->json, ",\"inode\":%u", inum);
+	if (blk)
+		fprintf (ck->json, ",\"block\":%u", blk);
+	if (path) {
+		fprintf (ck->json, ",\"path\":");
+		u6fs_json_string (ck->json, path, strlen (path));
+	}
+	fprintf (ck->json, "}\n");
 }
 
-static void print_io_error (char *s, unsigned short blk)
+static void print_io_error (u6fs_check_t *ck, char *s, unsigned short blk)
 {
-	printf ("\nCAN NOT %s: BLK %d\n", s, blk);
+	fprintf (ck->out, "\nCAN NOT %s: BLK %d\n", s, blk);
+	finding (ck, *s == 'R' ? "CAN NOT READ" : "CAN NOT WRITE", 0, blk, 0);
 }
 
-static void buf_flush (u6fs_t *fs)
+static void buf_flush (u6fs_check_t *ck)
 {
-	if (buf_dirty && fs->writable) {
+	u6fs_t *fs = ck->fs;
+	if (ck->buf_dirty && fs->writable) {
 /*printf ("WRITE blk %d\n", buf_bno);*/
-		if (! u6fs_write_block (fs, buf_bno, buf_data))
-			print_io_error ("WRITE", buf_bno);
+		if (! u6fs_write_block (fs, ck->buf_bno, ck->buf_data))
+			print_io_error (ck, "WRITE", ck->buf_bno);
 	}
-	buf_dirty = 0;
+	ck->buf_dirty = 0;
 }
 
-static int buf_get (u6fs_t *fs, unsigned short blk)
+static int buf_get (u6fs_check_t *ck, unsigned short blk)
 {
-	if (buf_bno == blk)
+	u6fs_t *fs = ck->fs;
+	if (ck->buf_bno == blk)
 		return 1;
-	buf_flush (fs);
+	buf_flush (ck);
 /*printf ("read blk %d\n", blk);*/
-	if (! u6fs_read_block (fs, blk, buf_data)) {
-		print_io_error ("READ", blk);
-		buf_bno = (unsigned short)-1;
+	if (! u6fs_read_block (fs, blk, ck->buf_data)) {
+		print_io_error (ck, "READ", blk);
+		ck->buf_bno = (unsigned short)-1;
 		return 0;
 	}
-	buf_bno = blk;
+	ck->buf_bno = blk;
 	return 1;
 }
 
@@ -155,8 +253,9 @@ static int buf_get (u6fs_t *fs, unsigned short blk)
  * Scan recursively the indirect block of the inode,
  * and for every block call the given function.
  */
-static int scan_indirect_block (u6fs_inode_t *inode, unsigned short blk,
-	int double_indirect, int flg, scanner_t *func, void *arg)
+static int scan_indirect_block (u6fs_check_t *ck, u6fs_inode_t *inode,
+	unsigned short blk, int double_indirect, int flg, scanner_t *func,
+	void *arg)
 {
 	unsigned short nb;
 	int ret, i;
@@ -164,7 +263,7 @@ static int scan_indirect_block (u6fs_inode_t *inode, unsigned short blk,
 
 /*printf ("check %siblock %d: \n", double_indirect ? "double " : "", blk);*/
 	if (flg == ADDR) {
-		ret = (*func) (inode, blk, arg);
+		ret = (*func) (ck, inode, blk, arg);
 		if (! (ret & KEEPON))
 			return ret;
 	}
@@ -172,17 +271,17 @@ static int scan_indirect_block (u6fs_inode_t *inode, unsigned short blk,
 		return SKIP;
 
 	if (! u6fs_read_block (inode->fs, blk, data)) {
-		print_io_error ("READ", blk);
+		print_io_error (ck, "READ", blk);
 		return SKIP;
 	}
 	for (i = 0; i < LSXFS_BSIZE; i+=2) {
 		nb = data [i+1] << 8 | data [i];
 		if (nb) {
 			if (double_indirect)
-				ret = scan_indirect_block (inode, nb,
+				ret = scan_indirect_block (ck, inode, nb,
 					0, flg, func, arg);
 			else
-				ret = (*func) (inode, nb, arg);
+				ret = (*func) (ck, inode, nb, arg);
 
 			if (ret & STOP)
 				return ret;
@@ -198,7 +297,8 @@ static int scan_indirect_block (u6fs_inode_t *inode, unsigned short blk,
  * - when ADDR - call func for both data and indirect blocks
  * - when DATA - only data blocks are processed
  */
-static int scan_inode (u6fs_inode_t *inode, int flg, scanner_t *func, void *arg)
+static int scan_inode (u6fs_check_t *ck, u6fs_inode_t *inode, int flg,
+	scanner_t *func, void *arg)
 {
 	unsigned short *ap;
 	int ret;
@@ -207,13 +307,13 @@ static int scan_inode (u6fs_inode_t *inode, int flg, scanner_t *func, void *arg)
 	if (((inode->mode & INODE_MODE_FMT) == INODE_MODE_FBLK) ||
 	    ((inode->mode & INODE_MODE_FMT) == INODE_MODE_FCHR))
 		return KEEPON;
-	scan_filesize = inode->size;
+	ck->scan_filesize = inode->size;
 
 	if (! (inode->mode & INODE_MODE_LARG)) {
 		/* Small file - up to 8 direct blocks. */
 		for (ap = inode->addr; ap < &inode->addr[8]; ap++) {
 			if (*ap) {
-				ret = (*func) (inode, *ap, arg);
+				ret = (*func) (ck, inode, *ap, arg);
 				if (ret & STOP)
 					return ret;
 			}
@@ -224,7 +324,7 @@ static int scan_inode (u6fs_inode_t *inode, int flg, scanner_t *func, void *arg)
 	 * one double indirect block. */
 	for (ap = inode->addr; ap < &inode->addr[7]; ap++) {
 		if (*ap) {
-			ret = scan_indirect_block (inode, *ap, 0,
+			ret = scan_indirect_block (ck, inode, *ap, 0,
 				flg, func, arg);
 			if (ret & STOP)
 				return (ret);
@@ -232,7 +332,7 @@ static int scan_inode (u6fs_inode_t *inode, int flg, scanner_t *func, void *arg)
 	}
 	if (inode->addr[7]) {
 		/* Check the last (indirect) block. */
-		ret = scan_indirect_block (inode, inode->addr[7], 1,
+		ret = scan_indirect_block (ck, inode, inode->addr[7], 1,
 			flg, func, arg);
 		if (ret & STOP)
 			return (ret);
@@ -240,74 +340,125 @@ static int scan_inode (u6fs_inode_t *inode, int flg, scanner_t *func, void *arg)
 	return KEEPON;
 }
 
-static void print_block_error (char *s, unsigned short blk, unsigned short inum)
+static void print_block_error (u6fs_check_t *ck, char *s, unsigned short blk,
+	unsigned short inum)
 {
-	printf ("%u %s I=%u\n", blk, s, inum);
+	fprintf (ck->out, "%u %s I=%u\n", blk, s, inum);
+	finding (ck, s, inum, blk, 0);
 }
 
 /*
  * Called once for every block of every file.
  * Mark blocks as busy on block map.
- * If duplicates are found, put them into dup_list.
+ * If duplicates are found, count them in dup_count.
  */
-static int pass1 (u6fs_inode_t *inode, unsigned short blk, void *arg)
+static int pass1 (u6fs_check_t *ck, u6fs_inode_t *inode, unsigned short blk,
+	void *arg)
 {
-	unsigned short *dlp;
-	unsigned short *blocks = arg;
-
 /*printf ("pass1 inode %d block %d: \n", inode->number, blk);*/
 	if (outrange (inode->fs, blk)) {
-		print_block_error ("BAD", blk, inode->number);
-		set_inode_state (inode->number, CLEAR);	/* mark for possible clearing */
-		if (++bad_blocks >= MAXBAD) {
-			printf ("EXCESSIVE BAD BLKS I=%u\n", inode->number);
+		print_block_error (ck, "BAD", blk, inode->number);
+		set_inode_state (ck, inode->number, CLEAR);	/* mark for possible clearing */
+		if (++ck->bad_blocks >= MAXBAD) {
+			fprintf (ck->out, "EXCESSIVE BAD BLKS I=%u\n",
+				inode->number);
 			return STOP;
 		}
 		return SKIP;
 	}
-	if (block_is_busy (blk)) {
-		print_block_error ("DUP", blk, inode->number);
-		set_inode_state (inode->number, CLEAR);	/* mark for possible clearing */
-		if (++dup_blocks >= MAXDUP) {
-			printf ("EXCESSIVE DUP BLKS I=%u\n", inode->number);
-			return STOP;
-		}
-		if (dup_end >= &dup_list[DUP_LIST_SIZE]) {
-			printf ("DUP TABLE OVERFLOW.\n");
+	if (block_is_busy (ck, blk)) {
+		print_block_error (ck, "DUP", blk, inode->number);
+		set_inode_state (ck, inode->number, CLEAR);	/* mark for possible clearing */
+		if (++ck->dup_blocks >= MAXDUP) {
+			fprintf (ck->out, "EXCESSIVE DUP BLKS I=%u\n",
+				inode->number);
 			return STOP;
 		}
-		for (dlp = dup_list; dlp < dup_multi; dlp++) {
-			if (*dlp == blk) {
-				*dup_end++ = blk;
-				break;
-			}
+		if (ck->dup_count [blk]++ == 0) {
+			/* First duplicate of this block. */
+			mark_dup_pending (ck, blk);
+			ck->dup_pending++;
 		}
-		if (dlp >= dup_multi) {
-			*dup_end++ = *dup_multi;
-			*dup_multi++ = blk;
-		}
-	} else {
-		if (blocks)
-			++*blocks;
-		mark_block_busy (blk);
-	}
+	} else
+		mark_block_busy (ck, blk);
 	return KEEPON;
 }
 
-static int pass1b (u6fs_inode_t *inode, unsigned short blk, void *arg)
+/*
+ * Block claimed by an inode, collected by phase 1 workers.
+ */
+typedef struct {
+	unsigned short	blk;
+	unsigned char	ioerr;		/* indirect block cannot be read */
+} claim_t;
+
+/*
+ * Chunk of the I list with claims of all its inodes.
+ */
+typedef struct {
+	unsigned char	*ilist;		/* I list blocks, or 0 on read error */
+	unsigned int	ninodes;
+	unsigned int	*first;		/* first claim, by inode in chunk */
+	claim_t		*claim;		/* claims, in order of scan_inode() */
+	unsigned int	nclaims, size;
+	int		bad;		/* bad blocks of current inode */
+} chunk_t;
+
+typedef struct {
+	u6fs_check_t	*ck;
+	chunk_t		*chunk;
+	unsigned int	nchunks;
+	unsigned int	next;		/* next chunk to take */
+	unsigned long	*shared;	/* blocks claimed more than once */
+	int		failed;		/* out of memory */
+	pthread_mutex_t	lock;		/* of fs->io */
+} phase1_t;
+
+static int is_shared (phase1_t *p, unsigned short blk)
+{
+	return (p->shared [map_word (blk)] & map_bit (blk)) != 0;
+}
+
+/*
+ * Pass the claims of the inode to pass1(), in the order
+ * they were found. Blocks, claimed by this inode only,
+ * are busy already. When pass1() stops the scan, the rest
+ * of such blocks are released.
+ */
+static void replay_claims (u6fs_check_t *ck, phase1_t *p,
+	u6fs_inode_t *inode, claim_t *claim, claim_t *end)
 {
-	unsigned short *dlp;
+	u6fs_t *fs = ck->fs;
+
+	for (; claim < end; claim++) {
+		if (claim->ioerr)
+			print_io_error (ck, "READ", claim->blk);
+		else if ((outrange (fs, claim->blk) ||
+		    is_shared (p, claim->blk)) &&
+		    (pass1 (ck, inode, claim->blk, 0) & STOP))
+			break;
+	}
+	if (claim == end)
+		return;
+	for (claim++; claim < end; claim++)
+		if (! claim->ioerr && ! outrange (fs, claim->blk) &&
+		    ! is_shared (p, claim->blk))
+			mark_block_free (ck, claim->blk);
+}
 
+/*
+ * Find the first owners of duplicate blocks.
+ */
+static int pass1b (u6fs_check_t *ck, u6fs_inode_t *inode, unsigned short blk,
+	void *arg)
+{
 	if (outrange (inode->fs, blk))
 		return SKIP;
-	for (dlp = dup_list; dlp < dup_multi; dlp++) {
-		if (*dlp == blk) {
-			print_block_error ("DUP", blk, inode->number);
-			set_inode_state (inode->number, CLEAR);	/* mark for possible clearing */
-			*dlp = *--dup_multi;
-			*dup_multi = blk;
-			return (dup_multi == dup_list ? STOP : KEEPON);
-		}
+	if (is_dup_pending (ck, blk)) {
+		print_block_error (ck, "DUP", blk, inode->number);
+		set_inode_state (ck, inode->number, CLEAR);	/* mark for possible clearing */
+		clear_dup_pending (ck, blk);
+		return (--ck->dup_pending == 0 ? STOP : KEEPON);
 	}
 	return KEEPON;
 }
@@ -316,7 +467,8 @@ static int pass1b (u6fs_inode_t *inode, unsigned short blk, void *arg)
  * Read directory, and for every entry call given function.
  * If function altered the contents of entry, then write it back.
  */
-static int scan_directory (u6fs_inode_t *inode, unsigned short blk, void *arg)
+static int scan_directory (u6fs_check_t *ck, u6fs_inode_t *inode,
+	unsigned short blk, void *arg)
 {
 	u6fs_dirent_t direntry;
 	unsigned char *dirp;
@@ -325,71 +477,86 @@ static int scan_directory (u6fs_inode_t *inode, unsigned short blk, void *arg)
 
 /*printf ("scan_directory: I=%d, blk=%d\n", inode->number, blk);*/
 	if (outrange (inode->fs, blk)) {
-		scan_filesize -= LSXFS_BSIZE;
+		ck->scan_filesize -= LSXFS_BSIZE;
 		return SKIP;
 	}
-	dirp = buf_data;
-	while (dirp < &buf_data[LSXFS_BSIZE] && scan_filesize > 0) {
-		if (! buf_get (inode->fs, blk)) {
-			scan_filesize -= (&buf_data[LSXFS_BSIZE] - dirp);
+	dirp = ck->buf_data;
+	while (dirp < &ck->buf_data[LSXFS_BSIZE] && ck->scan_filesize > 0) {
+		if (! buf_get (ck, blk)) {
+			ck->scan_filesize -= (&ck->buf_data[LSXFS_BSIZE] -
+				dirp);
 			return SKIP;
 		}
 		u6fs_dirent_unpack (&direntry, dirp);
 
 		/* For every directory entry, call handler. */
-		n = (*func) (inode->fs, &direntry);
+		n = (*func) (ck, &direntry);
 
 		if (n & ALTERD) {
-			if (buf_get (inode->fs, blk)) {
+			if (buf_get (ck, blk)) {
 				u6fs_dirent_pack (dirp, &direntry);
-				buf_dirty = 1;
+				ck->buf_dirty = 1;
 			} else
 				n &= ~ALTERD;
 		}
 		if (n & STOP)
 			return n;
 		dirp += 16;
-		scan_filesize -= 16;
+		ck->scan_filesize -= 16;
 	}
-	return (scan_filesize > 0) ? KEEPON : STOP;
+	return (ck->scan_filesize > 0) ? KEEPON : STOP;
 }
 
-static void print_inode (u6fs_inode_t *inode)
+static void print_inode (u6fs_check_t *ck, u6fs_inode_t *inode)
 {
-	char *p;
+	char *p, buf [32];
         time_t mt;
 
-	printf (" I=%u ", inode->number);
-	printf (" OWNER=%d ", inode->uid);
-	printf ("MODE=%o\n", inode->mode);
-	printf ("SIZE=%ld ", inode->size);
+	fprintf (ck->out, " I=%u ", inode->number);
+	fprintf (ck->out, " OWNER=%d ", inode->uid);
+	fprintf (ck->out, "MODE=%o\n", inode->mode);
+	fprintf (ck->out, "SIZE=%ld ", inode->size);
         mt = inode->mtime;
-	p = ctime (&mt /*inode->mtime*/);
-	printf ("MTIME=%12.12s %4.4s\n", p+4, p+20);
+	p = ctime_r (&mt, buf);
+	fprintf (ck->out, "MTIME=%12.12s %4.4s\n", p+4, p+20);
 }
 
-static void print_dir_error (u6fs_t *fs, unsigned short inum, char *s)
+/*
+ * In verbose mode, name the file found outside of the tree walk.
+ */
+static void print_path (u6fs_check_t *ck, unsigned short inum)
+{
+	char path [256];
+
+	if (verbose && inode_path (ck, inum, path, sizeof (path)))
+		fprintf (ck->out, "FILE=%s\n", path);
+}
+
+static void print_dir_error (u6fs_check_t *ck, unsigned short inum, char *s)
 {
+	u6fs_t *fs = ck->fs;
 	u6fs_inode_t inode;
 
+	finding (ck, s, inum, 0, ck->pathname);
 	if (! u6fs_inode_get (fs, &inode, inum)) {
-		printf ("%s  I=%u\nNAME=%s\n", s, inum, pathname);
+		fprintf (ck->out, "%s  I=%u\nNAME=%s\n", s, inum, ck->pathname);
 		return;
 	}
-	printf ("%s ", s);
-	print_inode (&inode);
-	printf ("%s=%s\n", ((inode.mode & INODE_MODE_FMT) ==
-		INODE_MODE_FDIR) ? "DIR" : "FILE", pathname);
+	fprintf (ck->out, "%s ", s);
+	print_inode (ck, &inode);
+	fprintf (ck->out, "%s=%s\n", ((inode.mode & INODE_MODE_FMT) ==
+		INODE_MODE_FDIR) ? "DIR" : "FILE", ck->pathname);
 }
 
-static void scan_pass2 (u6fs_t *fs, unsigned short inum);
+static void scan_pass2 (u6fs_check_t *ck, unsigned short inum);
 
 /*
  * Clear directory entries which refer to duplicated or unallocated inodes.
  * Decrement link counters.
  */
-static int pass2 (u6fs_t *fs, u6fs_dirent_t *dirp)
+static int pass2 (u6fs_check_t *ck, u6fs_dirent_t *dirp)
 {
+	u6fs_t *fs = ck->fs;
 	int inum, n, ret = KEEPON;
 	u6fs_inode_t inode;
 
@@ -398,18 +565,18 @@ static int pass2 (u6fs_t *fs, u6fs_dirent_t *dirp)
 		return KEEPON;
 
 	/* Copy file name from dirp to pathp */
-	thisname = pathp;
-	strcpy (pathp, dirp->name);
-	pathp += strlen (pathp);
+	ck->thisname = ck->pathp;
+	strcpy (ck->pathp, dirp->name);
+	ck->pathp += strlen (ck->pathp);
 /*printf ("%s  %d\n", pathname, inum);*/
 	n = 0;
 	if (inum > fs->isize * LSXFS_INODES_PER_BLOCK ||
 	    inum < LSXFS_ROOT_INODE)
-		print_dir_error (fs, inum, "I OUT OF RANGE");
+		print_dir_error (ck, inum, "I OUT OF RANGE");
 	else {
-again:		switch (inode_state (inum)) {
+again:		switch (inode_state (ck, inum)) {
 		case USTATE:
-			print_dir_error (fs, inum, "UNALLOCATED");
+			print_dir_error (ck, inum, "UNALLOCATED");
 			if (fs->writable) {
 				dirp->ino = 0;
 				ret |= ALTERD;
@@ -417,7 +584,7 @@ again:		switch (inode_state (inum)) {
 			}
 			break;
 		case CLEAR:
-			print_dir_error (fs, inum, "DUP/BAD");
+			print_dir_error (ck, inum, "DUP/BAD");
 			if (fs->writable) {
 				dirp->ino = 0;
 				ret |= ALTERD;
@@ -425,18 +592,19 @@ again:		switch (inode_state (inum)) {
 			}
 			if (! u6fs_inode_get (fs, &inode, inum))
 				break;
-			set_inode_state (inum, ((inode.mode & INODE_MODE_FMT) ==
+			set_inode_state (ck, inum,
+				((inode.mode & INODE_MODE_FMT) ==
 				INODE_MODE_FDIR) ? DSTATE : FSTATE);
 			goto again;
 		case FSTATE:
-			--link_count [inum];
+			--ck->link_count [inum];
 			break;
 		case DSTATE:
-			--link_count [inum];
-			scan_pass2 (fs, inum);
+			--ck->link_count [inum];
+			scan_pass2 (ck, inum);
 		}
 	}
-	pathp = thisname;
+	ck->pathp = ck->thisname;
 	return ret;
 }
 
@@ -444,22 +612,22 @@ again:		switch (inode_state (inum)) {
  * Traverse directory tree. Call pass2 for every directory entry.
  * Keep current file name in 'pathname'.
  */
-static void scan_pass2 (u6fs_t *fs, unsigned short inum)
+static void scan_pass2 (u6fs_check_t *ck, unsigned short inum)
 {
 	u6fs_inode_t inode;
 	char *savname;
 	unsigned int savsize;
 
-	set_inode_state (inum, FSTATE);
-	if (! u6fs_inode_get (fs, &inode, inum))
+	set_inode_state (ck, inum, FSTATE);
+	if (! u6fs_inode_get (ck->fs, &inode, inum))
 		return;
-	*pathp++ = '/';
-	savname = thisname;
-	savsize = scan_filesize;
-	scan_inode (&inode, DATA, scan_directory, pass2);
-	scan_filesize = savsize;
-	thisname = savname;
-	*--pathp = 0;
+	*ck->pathp++ = '/';
+	savname = ck->thisname;
+	savsize = ck->scan_filesize;
+	scan_inode (ck, &inode, DATA, scan_directory, pass2);
+	ck->scan_filesize = savsize;
+	ck->thisname = savname;
+	*--ck->pathp = 0;
 }
 
 /*
@@ -467,142 +635,390 @@ static void scan_pass2 (u6fs_t *fs, unsigned short inum)
  * The name is in 'find_inode_name'.
  * Put resulting inode number into 'find_inode_result'.
  */
-static int find_inode (u6fs_t *fs, u6fs_dirent_t *dirp)
+static int find_inode (u6fs_check_t *ck, u6fs_dirent_t *dirp)
 {
+	u6fs_t *fs = ck->fs;
 	if (dirp->ino == 0)
 		return KEEPON;
-	if (strcmp (find_inode_name, dirp->name) == 0) {
+	if (strcmp (ck->find_inode_name, dirp->name) == 0) {
 		if (dirp->ino >= LSXFS_ROOT_INODE &&
 		    dirp->ino <= fs->isize * LSXFS_INODES_PER_BLOCK)
-			find_inode_result = dirp->ino;
+			ck->find_inode_result = dirp->ino;
 		return STOP;
 	}
 	return KEEPON;
 }
 
 /*
- * Find a free slot and make link to 'lost_inode'.
- * Create filename of a kind "#01234".
+ * Find a free slot and make link to the next file
+ * of 'lost_list'. Create filename of a kind "#01234".
  */
-static int make_lost_entry (u6fs_t *fs, u6fs_dirent_t *dirp)
+static int make_lost_entry (u6fs_check_t *ck, u6fs_dirent_t *dirp)
 {
 	if (dirp->ino)
 		return KEEPON;
-	dirp->ino = lost_inode;
+	dirp->ino = ck->lost_list [ck->lost_next++];
 	sprintf (dirp->name, "#%05d", dirp->ino);
+	return ALTERD | (ck->lost_next < ck->lost_count ? KEEPON : STOP);
+}
+
+/*
+ * Find a free slot and make link to 'lost_found_inode'.
+ */
+static int make_lost_found_entry (u6fs_check_t *ck, u6fs_dirent_t *dirp)
+{
+	if (dirp->ino)
+		return KEEPON;
+	dirp->ino = ck->lost_found_inode;
+	strcpy (dirp->name, lost_found_name);
 	return ALTERD | STOP;
 }
 
+/*
+ * Count free slots of the directory in 'lost_free'.
+ */
+static int count_free_entry (u6fs_check_t *ck, u6fs_dirent_t *dirp)
+{
+	if (dirp->ino == 0)
+		ck->lost_free++;
+	return KEEPON;
+}
+
 /*
  * For entry ".." set inode number to 'lost_found_inode'.
  */
-static int dotdot_to_lost_found (u6fs_t *fs, u6fs_dirent_t *dirp)
+static int dotdot_to_lost_found (u6fs_check_t *ck, u6fs_dirent_t *dirp)
 {
 	if (dirp->name[0] == '.' && dirp->name[1] == '.' &&
 	    dirp->name[2] == 0) {
-		dirp->ino = lost_found_inode;
+		dirp->ino = ck->lost_found_inode;
 		return ALTERD | STOP;
 	}
 	return KEEPON;
 }
 
+/*
+ * Allocate a block for a directory. Take it from the head
+ * of the free list, when it is sane, so that the list stays
+ * valid. Otherwise take any block, not used by files, and
+ * leave the free list to be rebuilt in phase 5.
+ */
+static unsigned short alloc_block (u6fs_check_t *ck)
+{
+	u6fs_t *fs = ck->fs;
+	unsigned int bno;
+
+	if (fs->nfree > 1 && fs->nfree <= 100) {
+		bno = fs->free [fs->nfree - 1];
+		if (! outrange (fs, bno) && ! block_is_busy (ck, bno)) {
+			fs->free [--fs->nfree] = 0;
+			fs->dirty = 1;
+			mark_block_busy (ck, bno);
+			return bno;
+		}
+	}
+	bno = map_next_clear (ck->block_map, fs->isize + 2, fs->fsize);
+	if (bno >= fs->fsize)
+		return 0;
+	mark_block_busy (ck, bno);
+	return bno;
+}
+
+/*
+ * Append a block to the directory, as logical block 'lbn'.
+ * A small directory is made large after 8 blocks.
+ */
+static int append_block (u6fs_check_t *ck, u6fs_inode_t *dir,
+	unsigned short lbn, unsigned short bno)
+{
+	u6fs_t *fs = ck->fs;
+	unsigned char data [LSXFS_BSIZE];
+	unsigned short ib;
+	int i;
+
+	if (! (dir->mode & INODE_MODE_LARG)) {
+		if (lbn < 8) {
+			dir->addr [lbn] = bno;
+			return 1;
+		}
+		/* Move direct blocks to the first indirect block. */
+		ib = alloc_block (ck);
+		if (! ib)
+			return 0;
+		memset (data, 0, LSXFS_BSIZE);
+		for (i = 0; i < 8; i++) {
+			data [i*2] = dir->addr [i];
+			data [i*2+1] = dir->addr [i] >> 8;
+		}
+		if (! u6fs_write_block (fs, ib, data))
+			return 0;
+		memset (dir->addr, 0, sizeof (dir->addr));
+		dir->addr [0] = ib;
+		dir->mode |= INODE_MODE_LARG;
+	}
+	i = lbn >> 8;
+	if (i >= 7)
+		return 0;
+	if (dir->addr [i] == 0) {
+		dir->addr [i] = alloc_block (ck);
+		if (! dir->addr [i])
+			return 0;
+		memset (data, 0, LSXFS_BSIZE);
+	} else if (! u6fs_read_block (fs, dir->addr [i], data))
+		return 0;
+	data [(lbn & 0377) * 2] = bno;
+	data [(lbn & 0377) * 2 + 1] = bno >> 8;
+	return u6fs_write_block (fs, dir->addr [i], data);
+}
+
+/*
+ * Extend the directory by a few empty blocks.
+ * The size is rounded up to whole blocks first.
+ * Return the number of blocks added.
+ */
+static int grow_directory (u6fs_check_t *ck, u6fs_inode_t *dir,
+	unsigned int nblocks)
+{
+	unsigned short bno, lbn;
+	unsigned int n;
+
+	lbn = (dir->size + LSXFS_BSIZE - 1) / LSXFS_BSIZE;
+	dir->size = lbn * LSXFS_BSIZE;
+	for (n = 0; n < nblocks; n++, lbn++) {
+		bno = alloc_block (ck);
+		if (! bno)
+			break;
+		if (! append_block (ck, dir, lbn, bno)) {
+			mark_block_free (ck, bno);
+			break;
+		}
+		/* The new block goes through the directory buffer. */
+		buf_flush (ck);
+		memset (ck->buf_data, 0, LSXFS_BSIZE);
+		ck->buf_bno = bno;
+		ck->buf_dirty = 1;
+		dir->size += LSXFS_BSIZE;
+	}
+	buf_flush (ck);
+	u6fs_inode_save (dir, 1);
+	return n;
+}
+
+/*
+ * Create /lost+found, with one empty block.
+ * Take an unused inode, which is not in the superblock cache.
+ */
+static unsigned short make_lost_found (u6fs_check_t *ck)
+{
+	u6fs_t *fs = ck->fs;
+	u6fs_inode_t root, dir;
+	u6fs_dirent_t dirent;
+	unsigned short inum, bno;
+	int i;
+
+	if (! u6fs_inode_get (fs, &root, LSXFS_ROOT_INODE) ||
+	    inode_state (ck, LSXFS_ROOT_INODE) != FSTATE)
+		return 0;
+	for (inum = LSXFS_ROOT_INODE + 1;
+	    inum <= fs->isize * LSXFS_INODES_PER_BLOCK; inum++) {
+		if (inode_state (ck, inum) != USTATE)
+			continue;
+		for (i = 0; i < fs->ninode; i++)
+			if (fs->inode [i] == inum)
+				break;
+		if (i >= fs->ninode)
+			break;
+	}
+	if (inum > fs->isize * LSXFS_INODES_PER_BLOCK ||
+	    ! u6fs_inode_get (fs, &dir, inum))
+		return 0;
+	bno = alloc_block (ck);
+	if (! bno)
+		return 0;
+
+	/* Directory block with "." and "..". */
+	buf_flush (ck);
+	memset (ck->buf_data, 0, LSXFS_BSIZE);
+	memset (&dirent, 0, sizeof (dirent));
+	dirent.ino = inum;
+	strcpy (dirent.name, ".");
+	u6fs_dirent_pack (ck->buf_data, &dirent);
+	dirent.ino = LSXFS_ROOT_INODE;
+	strcpy (dirent.name, "..");
+	u6fs_dirent_pack (ck->buf_data + 16, &dirent);
+	ck->buf_bno = bno;
+	ck->buf_dirty = 1;
+	buf_flush (ck);
+
+	u6fs_inode_clear (&dir);
+	dir.mode = INODE_MODE_ALLOC | INODE_MODE_FDIR | 0755;
+	dir.nlink = 2;
+	dir.size = LSXFS_BSIZE;
+	dir.addr [0] = bno;
+	if (! u6fs_inode_save (&dir, 1))
+		return 0;
+	set_inode_state (ck, inum, FSTATE);
+	ck->link_count [inum] = 0;
+	ck->total_files++;
+
+	/* Link it to the root, growing the root when full. */
+	ck->lost_found_inode = inum;
+	if ((scan_inode (ck, &root, DATA, scan_directory,
+	    make_lost_found_entry) & ALTERD) == 0) {
+		if (grow_directory (ck, &root, 1) != 1 ||
+		    (scan_inode (ck, &root, DATA, scan_directory,
+		    make_lost_found_entry) & ALTERD) == 0) {
+			ck->lost_found_inode = 0;
+			return 0;
+		}
+	}
+	buf_flush (ck);
+	if (! u6fs_inode_get (fs, &root, LSXFS_ROOT_INODE))
+		return 0;
+	root.nlink++;
+	u6fs_inode_save (&root, 1);
+	fprintf (ck->out, "NO lost+found DIRECTORY. CREATED I=%u\n\n", inum);
+	return inum;
+}
+
 /*
  * Return lost+found inode number.
- * TODO: create /lost+found when not available.
+ * Create /lost+found when not available.
  */
-static unsigned short find_lost_found (u6fs_t *fs)
+static unsigned short find_lost_found (u6fs_check_t *ck)
 {
+	u6fs_t *fs = ck->fs;
 	u6fs_inode_t root;
 
 	/* Find lost_found directory inode number. */
 	if (! u6fs_inode_get (fs, &root, LSXFS_ROOT_INODE))
 		return 0;
-	find_inode_name = lost_found_name;
-	find_inode_result = 0;
-	scan_inode (&root, DATA, scan_directory, find_inode);
-	return find_inode_result;
+	ck->find_inode_name = lost_found_name;
+	ck->find_inode_result = 0;
+	scan_inode (ck, &root, DATA, scan_directory, find_inode);
+	if (ck->find_inode_result == 0)
+		return make_lost_found (ck);
+	return ck->find_inode_result;
 }
 
 /*
- * Restore a link to parent directory - "..".
+ * Reconnect the file to lost+found.
+ * Links are only counted here: entries of all reconnected
+ * files are written at once by flush_lost_found().
  */
-static int move_to_lost_found (u6fs_inode_t *inode)
+static int move_to_lost_found (u6fs_check_t *ck, u6fs_inode_t *inode)
 {
 	u6fs_inode_t lost_found;
 
-	printf ("UNREF %s ", ((inode->mode & INODE_MODE_FMT) ==
+	finding (ck, "UNREF", inode->number, 0, 0);
+	fprintf (ck->out, "UNREF %s ", ((inode->mode & INODE_MODE_FMT) ==
 		INODE_MODE_FDIR) ? "DIR" : "FILE");
-	print_inode (inode);
+	print_inode (ck, inode);
+	print_path (ck, inode->number);
 	if (! inode->fs->writable)
 		return 0;
 
 	/* Get lost+found inode. */
-	if (lost_found_inode == 0) {
+	if (ck->lost_found_inode == 0) {
 		/* Find lost_found directory inode number. */
-		lost_found_inode = find_lost_found (inode->fs);
-		if (! lost_found_inode) {
-			printf ("SORRY. NO lost+found DIRECTORY\n\n");
+		ck->lost_found_inode = find_lost_found (ck);
+		if (! ck->lost_found_inode) {
+			fprintf (ck->out, "SORRY. NO lost+found DIRECTORY\n\n");
 			return 0;
 		}
 	}
-	if (! u6fs_inode_get (inode->fs, &lost_found, lost_found_inode) ||
+	if (! u6fs_inode_get (inode->fs, &lost_found, ck->lost_found_inode) ||
 	    ((lost_found.mode & INODE_MODE_FMT) != INODE_MODE_FDIR) ||
-	    inode_state (lost_found_inode) != FSTATE) {
-		printf ("SORRY. NO lost+found DIRECTORY\n\n");
+	    inode_state (ck, ck->lost_found_inode) != FSTATE) {
+		fprintf (ck->out, "SORRY. NO lost+found DIRECTORY\n\n");
 		return 0;
 	}
-	if (lost_found.size % LSXFS_BSIZE) {
-		lost_found.size = (lost_found.size + LSXFS_BSIZE - 1) /
-			LSXFS_BSIZE * LSXFS_BSIZE;
-		if (! u6fs_inode_save (&lost_found, 1)) {
-			printf ("SORRY. ERROR WRITING lost+found I-NODE\n\n");
+	if (! ck->lost_list) {
+		ck->lost_list = malloc ((inode->fs->isize *
+			LSXFS_INODES_PER_BLOCK + 1) * sizeof (*ck->lost_list));
+		if (! ck->lost_list) {
+			fprintf (ck->out,
+				"SORRY. NO SPACE IN lost+found DIRECTORY\n\n");
 			return 0;
 		}
 	}
 
 	/* Put a file to lost+found. */
-	lost_inode = inode->number;
-	if ((scan_inode (&lost_found, DATA, scan_directory, make_lost_entry) &
-	    ALTERD) == 0) {
-		printf ("SORRY. NO SPACE IN lost+found DIRECTORY\n\n");
-		return 0;
-	}
-	--link_count [inode->number];
+	ck->lost_list [ck->lost_count++] = inode->number;
+	--ck->link_count [inode->number];
 
 	if ((inode->mode & INODE_MODE_FMT) == INODE_MODE_FDIR) {
 		/* For ".." set inode number to lost_found_inode. */
-		scan_inode (inode, DATA, scan_directory, dotdot_to_lost_found);
-		if (u6fs_inode_get (inode->fs, &lost_found, lost_found_inode)) {
-			lost_found.nlink++;
-			++link_count [lost_found.number];
-			if (! u6fs_inode_save (&lost_found, 1)) {
-				printf ("SORRY. ERROR WRITING lost+found I-NODE\n\n");
-				return 0;
-			}
+		scan_inode (ck, inode, DATA, scan_directory,
+			dotdot_to_lost_found);
+		lost_found.nlink++;
+		++ck->link_count [lost_found.number];
+		if (! u6fs_inode_save (&lost_found, 1)) {
+			fprintf (ck->out, "SORRY. ERROR WRITING "
+				"lost+found I-NODE\n\n");
+			return 0;
 		}
-		printf ("DIR I=%u CONNECTED.\n\n", inode->number);
+		fprintf (ck->out, "DIR I=%u CONNECTED.\n\n", inode->number);
 	}
 	return 1;
 }
 
 /*
- * Mark the block as free. Remove it from dup list.
+ * Write entries of all reconnected files to lost+found.
+ * The directory is grown at once by the number of blocks
+ * needed, then free slots are filled in a single pass,
+ * so every directory block is written only once.
+ */
+static void flush_lost_found (u6fs_check_t *ck)
+{
+	u6fs_inode_t lost_found;
+	unsigned int need;
+
+	if (ck->lost_count == 0)
+		goto done;
+	if (! u6fs_inode_get (ck->fs, &lost_found, ck->lost_found_inode)) {
+		fprintf (ck->out, "SORRY. ERROR READING lost+found I-NODE\n\n");
+		goto done;
+	}
+	if (lost_found.size % LSXFS_BSIZE)
+		grow_directory (ck, &lost_found, 0);
+	ck->lost_free = 0;
+	scan_inode (ck, &lost_found, DATA, scan_directory, count_free_entry);
+	if (ck->lost_free < ck->lost_count) {
+		need = (ck->lost_count - ck->lost_free + LSXFS_BSIZE/16 - 1) /
+			(LSXFS_BSIZE/16);
+		grow_directory (ck, &lost_found, need);
+	}
+
+	ck->lost_next = 0;
+	scan_inode (ck, &lost_found, DATA, scan_directory, make_lost_entry);
+	if (ck->lost_next < ck->lost_count)
+		fprintf (ck->out, "SORRY. NO SPACE IN lost+found DIRECTORY "
+			"FOR %u FILES\n\n", ck->lost_count - ck->lost_next);
+done:
+	buf_flush (ck);
+	free (ck->lost_list);
+	ck->lost_list = 0;
+	ck->lost_count = 0;
+}
+
+/*
+ * Mark the block as free, unless it is claimed by other files.
  */
-static int pass4 (u6fs_inode_t *inode, unsigned short blk, void *arg)
+static int pass4 (u6fs_check_t *ck, u6fs_inode_t *inode, unsigned short blk,
+	void *arg)
 {
-	unsigned short *dlp;
 	unsigned short *blocks = arg;
 
 	if (outrange (inode->fs, blk))
 		return SKIP;
-	if (block_is_busy (blk)) {
+	if (block_is_busy (ck, blk)) {
 		/* Free block. */
-		for (dlp = dup_list; dlp < dup_end; dlp++)
-			if (*dlp == blk) {
-				*dlp = *--dup_end;
-				return KEEPON;
-			}
-		mark_block_free (blk);
+		if (ck->dup_count [blk]) {
+			ck->dup_count [blk]--;
+			return KEEPON;
+		}
+		mark_block_free (ck, blk);
 		if (blocks)
 			--*blocks;
 	}
@@ -612,20 +1028,24 @@ static int pass4 (u6fs_inode_t *inode, unsigned short blk, void *arg)
 /*
  * Clear the inode, mark it's blocks as free.
  */
-static void clear_inode (u6fs_t *fs, unsigned short inum, char *msg)
+static void clear_inode (u6fs_check_t *ck, unsigned short inum, char *msg)
 {
+	u6fs_t *fs = ck->fs;
 	u6fs_inode_t inode;
 
 	if (! u6fs_inode_get (fs, &inode, inum))
 		return;
 	if (msg) {
-		printf ("%s %s", msg, ((inode.mode & INODE_MODE_FMT) ==
-			INODE_MODE_FDIR) ? "DIR" : "FILE");
-		print_inode (&inode);
+		finding (ck, msg, inum, 0, 0);
+		fprintf (ck->out, "%s %s", msg,
+			((inode.mode & INODE_MODE_FMT) == INODE_MODE_FDIR) ?
+			"DIR" : "FILE");
+		print_inode (ck, &inode);
+		print_path (ck, inode.number);
 	}
 	if (fs->writable) {
-		total_files--;
-		scan_inode (&inode, ADDR, pass4, 0);
+		ck->total_files--;
+		scan_inode (ck, &inode, ADDR, pass4, 0);
 		u6fs_inode_clear (&inode);
 		u6fs_inode_save (&inode, 1);
 	}
@@ -635,22 +1055,27 @@ static void clear_inode (u6fs_t *fs, unsigned short inum, char *msg)
  * Fix the link count of the inode.
  * If no links - move it to lost+found.
  */
-static void adjust_link_count (u6fs_t *fs, unsigned short inum, short lcnt)
+static void adjust_link_count (u6fs_check_t *ck, unsigned short inum,
+	short lcnt)
 {
+	u6fs_t *fs = ck->fs;
 	u6fs_inode_t inode;
 
 	if (! u6fs_inode_get (fs, &inode, inum))
 		return;
 	if (inode.nlink == lcnt) {
 		/* No links to file - move to lost+found. */
-		if (! move_to_lost_found (&inode))
-			clear_inode (fs, inum, 0);
+		if (! move_to_lost_found (ck, &inode))
+			clear_inode (ck, inum, 0);
 	} else {
-		printf ("LINK COUNT %s", (lost_found_inode==inum) ? lost_found_name :
+		finding (ck, "LINK COUNT", inum, 0, 0);
+		fprintf (ck->out, "LINK COUNT %s",
+			(ck->lost_found_inode==inum) ? lost_found_name :
 			(((inode.mode & INODE_MODE_FMT) == INODE_MODE_FDIR) ?
 			"DIR" : "FILE"));
-		print_inode (&inode);
-		printf ("COUNT %d SHOULD BE %d\n",
+		print_inode (ck, &inode);
+		print_path (ck, inode.number);
+		fprintf (ck->out, "COUNT %d SHOULD BE %d\n",
 			inode.nlink, inode.nlink - lcnt);
 		if (fs->writable) {
 			inode.nlink -= lcnt;
@@ -663,61 +1088,61 @@ static void adjust_link_count (u6fs_t *fs, unsigned short inum, short lcnt)
  * Called from check_free_list() for every block in free list.
  * Count free blocks, detect duplicates.
  */
-static int pass5 (u6fs_t *fs, unsigned short blk, unsigned short *free_blocks)
+static int pass5 (u6fs_check_t *ck, unsigned short blk)
 {
+	u6fs_t *fs = ck->fs;
 	if (outrange (fs, blk)) {
-		free_list_corrupted = 1;
-		if (++bad_blocks >= MAXBAD) {
-			printf ("EXCESSIVE BAD BLKS IN FREE LIST.\n");
+		ck->free_list_corrupted = 1;
+		if (++ck->bad_blocks >= MAXBAD) {
+			fprintf (ck->out, "EXCESSIVE BAD BLKS IN FREE LIST.\n");
 			return STOP;
 		}
 		return SKIP;
 	}
-	if (in_free_list (blk)) {
-		free_list_corrupted = 1;
-		if (++dup_blocks >= DUP_LIST_SIZE) {
-			printf ("EXCESSIVE DUP BLKS IN FREE LIST.\n");
+	if (in_free_list (ck, blk)) {
+		ck->free_list_corrupted = 1;
+		if (++ck->dup_blocks >= MAXFREEDUP) {
+			fprintf (ck->out, "EXCESSIVE DUP BLKS IN FREE LIST.\n");
 			return STOP;
 		}
-	} else {
-		++*free_blocks;
-		mark_free_list (blk);
-	}
+	} else
+		mark_free_list (ck, blk);
 	return KEEPON;
 }
 
 /*
  * Scan a free block list and return a number of free blocks.
  * If the list is corrupted, set 'free_list_corrupted' flag.
+ * The free map must be a copy of the block map on entry.
  */
-static unsigned short check_free_list (u6fs_t *fs)
+static unsigned short check_free_list (u6fs_check_t *ck)
 {
+	u6fs_t *fs = ck->fs;
 	unsigned short *ap, *base;
-	unsigned short free_blocks, nfree;
+	unsigned short nfree;
 	unsigned short data [256];
 	unsigned short list [100];
 	int i;
 
 	if (fs->nfree == 0)
 		return 0;
-	free_blocks = 0;
 	nfree = fs->nfree;
 	base = fs->free;
 	for (;;) {
 		if (nfree <= 0 || nfree > 100) {
-			printf ("BAD FREEBLK COUNT\n");
-			free_list_corrupted = 1;
+			fprintf (ck->out, "BAD FREEBLK COUNT\n");
+			ck->free_list_corrupted = 1;
 			break;
 		}
 		ap = base + nfree;
 		while (--ap > base) {
-			if (pass5 (fs, *ap, &free_blocks) == STOP)
-				return free_blocks;
+			if (pass5 (ck, *ap) == STOP)
+				goto done;
 		}
-		if (*ap == 0 || pass5 (fs, *ap, &free_blocks) != KEEPON)
+		if (*ap == 0 || pass5 (ck, *ap) != KEEPON)
 			break;
 		if (! u6fs_read_block (fs, *ap, (char*) data)) {
-			print_io_error ("READ", *ap);
+			print_io_error (ck, "READ", *ap);
 			break;
 		}
 		nfree = lsb_short (data[0]);
@@ -725,23 +1150,50 @@ static unsigned short check_free_list (u6fs_t *fs)
 			list [i] = lsb_short (data[i+1]);
 		base = list;
 	}
-	return free_blocks;
+done:
+	/* Blocks in the free map, which are not busy. */
+	return map_count (ck->free_map, 0, fs->fsize) -
+		map_count (ck->block_map, 0, fs->fsize);
+}
+
+/*
+ * Print blocks, which are neither busy nor in the free list.
+ */
+static void print_missing (u6fs_check_t *ck)
+{
+	u6fs_t *fs = ck->fs;
+	unsigned int bno, n = 0;
+
+	bno = map_next_clear (ck->free_map, fs->isize + 2, fs->fsize);
+	for (; bno < fs->fsize; bno = map_next_clear (ck->free_map,
+	    bno + 1, fs->fsize)) {
+		fprintf (ck->out, "%s%u", n++ % 10 ? " " : "MISSING BLKS: ",
+			bno);
+		if (n % 10 == 0)
+			fprintf (ck->out, "\n");
+	}
+	if (n % 10)
+		fprintf (ck->out, "\n");
 }
 
 /*
  * Check a list of free inodes.
  */
-static void check_free_inode_list (u6fs_t *fs)
+static void check_free_inode_list (u6fs_check_t *ck)
 {
+	u6fs_t *fs = ck->fs;
 	int i;
 	unsigned short inum;
 
 	for (i=0; i<fs->ninode; i++) {
 		inum = fs->inode[i];
-		if (inode_state (inum) != USTATE) {
-			printf ("ALLOCATED INODE(S) IN IFREE LIST\n");
+		if (inum == 0 || inum > fs->isize * LSXFS_INODES_PER_BLOCK ||
+		    inode_state (ck, inum) != USTATE) {
+			fprintf (ck->out, "ALLOCATED INODE(S) IN IFREE LIST\n");
+			finding (ck, "ALLOCATED INODE IN IFREE LIST", inum, 0, 0);
 			if (fs->writable) {
-				fs->ninode = i - 1;
+				/* Keep the entries, checked so far. */
+				fs->ninode = i;
 				while (i < 100)
 					fs->inode [i++] = 0;
 				fs->dirty = 1;
@@ -754,9 +1206,13 @@ static void check_free_inode_list (u6fs_t *fs)
 /*
  * Build a free block list from scratch.
  */
-static unsigned short make_free_list (u6fs_t *fs)
+static unsigned short make_free_list (u6fs_check_t *ck)
 {
-	unsigned short free_blocks, n;
+	u6fs_t *fs = ck->fs;
+	unsigned short free_blocks;
+	unsigned int n, bit;
+	unsigned long w;
+	int i;
 
 	fs->nfree = 0;
 	fs->flock = 0;
@@ -766,122 +1222,973 @@ static unsigned short make_free_list (u6fs_t *fs)
 	fs->dirty = 1;
 	free_blocks = 0;
 
-	/* Build a list of free blocks */
+	/* Build a list of free blocks, in descending order.
+	 * Take a word of the map at once, skip busy words. */
 	u6fs_block_free (fs, 0);
-	for (n = fs->fsize - 1; n >= fs->isize + 2; n--) {
-		if (block_is_busy (n))
-			continue;
-		++free_blocks;
-		if (! u6fs_block_free (fs, n))
-			return 0;
+	for (i = map_word (fs->fsize - 1); i >= 0; i--) {
+		w = ~ck->block_map [i];
+		while (w) {
+			bit = MAP_BITS - 1 - __builtin_clzl (w);
+			w &= ~(1UL << bit);
+			n = i * MAP_BITS + bit;
+			if (n >= fs->fsize)
+				continue;
+			if (n < fs->isize + 2)
+				return free_blocks;
+			++free_blocks;
+			if (! u6fs_block_free (fs, n))
+				return 0;
+		}
 	}
 	return free_blocks;
 }
 
 /*
- * Check filesystem for errors.
- * When readonly - just check and print errors.
- * If the system is open on read/write - fix errors.
+ * Print the title of the next phase, and account the time
+ * spent in the previous one. Phase -1 means the end of check.
  */
-int u6fs_check (u6fs_t *fs)
+static void begin_phase (u6fs_check_t *ck, int phase, char *title)
 {
-	u6fs_inode_t inode;
-	int n;
-	unsigned short inum;
-	unsigned short block_map_size;		/* number of free blocks */
-	unsigned short free_blocks;		/* number of free blocks */
-	unsigned short used_blocks;		/* number of blocks used */
-	unsigned short last_allocated_inode;	/* hiwater mark of inodes */
+	u6fs_iostat_t io = ck->fs->io, *start = &ck->phase_start_io;
+	u6fs_iostat_t *sum;
+	struct timespec ts;
+	double t;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	t = ts.tv_sec + ts.tv_nsec / 1e9;
+	if (ck->phase >= 0) {
+		ck->phase_time [ck->phase] += t - ck->phase_start;
+		sum = &ck->phase_io [ck->phase];
+		sum->reads += io.reads - start->reads;
+		sum->read_bytes += io.read_bytes - start->read_bytes;
+		sum->writes += io.writes - start->writes;
+		sum->write_bytes += io.write_bytes - start->write_bytes;
+		sum->inodes += io.inodes - start->inodes;
+	}
+	ck->phase = phase;
+	ck->phase_start = t;
+	*start = io;
+	if (phase < 0 && ck->pathmap) {
+		/* The check is over, names are not needed anymore. */
+		u6fs_pathmap_free (ck->pathmap);
+		free (ck->pathmap);
+		ck->pathmap = 0;
+	}
+	if (title)
+		fprintf (ck->out, "%s", title);
+}
 
-	if (fs->isize + 2 >= fs->fsize) {
-		printf ("Bad filesystem size: total %d blocks with %d inode blocks\n",
-			fs->fsize, fs->isize);
-		return 0;
+/*
+ * In JSON mode, report the cost of every phase, which was run,
+ * and the totals of the check.
+ */
+static void report_json (u6fs_check_t *ck, int ok)
+{
+	u6fs_iostat_t *io;
+	int i;
+
+	if (! ck->json)
+		return;
+	for (i = 0; i < U6FS_CHECK_PHASES; i++) {
+		if (ck->phase_time [i] == 0)
+			continue;
+		io = &ck->phase_io [i];
+		fprintf (ck->json, "{\"phase\":\"%s\",\"time\":%.6f,"
+			"\"reads\":%lu,\"read_blocks\":%lu,"
+			"\"writes\":%lu,\"write_blocks\":%lu,"
+			"\"inodes\":%lu}\n", phase_name [i], ck->phase_time [i],
+			io->reads, (io->read_bytes + 511) / 512,
+			io->writes, (io->write_bytes + 511) / 512, io->inodes);
 	}
-	free_list_corrupted = 0;
-	total_files = 0;
-	used_blocks = 0;
-	dup_multi = dup_end = &dup_list[0];
-	bad_link_end = &bad_link_list[0];
-	lost_found_inode = 0;
-	buf_dirty = 0;
-	buf_bno = (unsigned short) -1;
+	fprintf (ck->json, "{\"status\":\"%s\",\"errors\":%u,"
+		"\"files\":%u,\"used\":%u,\"free\":%u,"
+		"\"modified\":%s,\"skipped\":%s}\n",
+		! ok ? "failed" : ck->suspended ? "suspended" :
+		ck->errors ? "errors" : "ok", ck->errors,
+		ck->total_files, ck->used_blocks, ck->free_blocks,
+		ck->fs->modified ? "true" : "false",
+		ck->skipped ? "true" : "false");
+	fflush (ck->json);
+}
 
-	/* Allocate memory. */
-	block_map_size = (fs->fsize + 7) / 8;
-	block_map = calloc (block_map_size, sizeof (*block_map));
-	state_map = calloc ((fs->isize * LSXFS_INODES_PER_BLOCK +
-		STATES_PER_BYTE) / STATES_PER_BYTE, sizeof (*state_map));
-	link_count = calloc (fs->isize * LSXFS_INODES_PER_BLOCK + 1,
-		sizeof (*link_count));
-	if (! block_map || ! state_map || ! link_count) {
-		printf ("Cannot allocate memory\n");
-fatal:		if (block_map)
-			free (block_map);
-		if (state_map)
-			free (state_map);
-		if (link_count)
-			free (link_count);
+/*
+ * Get the name of the phase, by index.
+ */
+const char *u6fs_check_phase_name (int phase)
+{
+	if (phase < 0 || phase >= U6FS_CHECK_PHASES)
+		return "";
+	return phase_name [phase];
+}
+
+/*
+ * Get the name of a file, which accompanies the image:
+ * the digest of the last clean check, or the checkpoint.
+ */
+static char *sidecar_name (u6fs_check_t *ck, char *suffix)
+{
+	char *name;
+
+	name = malloc (strlen (ck->fs->filename) + strlen (suffix) + 1);
+	if (name) {
+		strcpy (name, ck->fs->filename);
+		strcat (name, suffix);
+	}
+	return name;
+}
+
+/*
+ * Compare the digest with the one stored by the last clean check.
+ * On match, restore the totals of that check and return 1.
+ */
+static int read_digest (u6fs_check_t *ck)
+{
+	char *name;
+	FILE *f;
+	unsigned long long digest;
+	unsigned int files, used, nfree;
+	int ok = 0;
+
+	name = sidecar_name (ck, ".fsck");
+	if (! name)
+		return 0;
+	f = fopen (name, "r");
+	free (name);
+	if (! f)
 		return 0;
+	if (fscanf (f, "u6fs-fsck %llx %u %u %u", &digest,
+	    &files, &used, &nfree) == 4 && digest == ck->digest) {
+		ck->total_files = files;
+		ck->used_blocks = used;
+		ck->free_blocks = nfree;
+		ok = 1;
 	}
+	fclose (f);
+	return ok;
+}
 
-	printf ("** Phase 1 - Check Blocks and Sizes\n");
-	last_allocated_inode = 0;
-	for (inum = 1; inum <= fs->isize * LSXFS_INODES_PER_BLOCK; inum++) {
-		if (! u6fs_inode_get (fs, &inode, inum))
-			continue;
-		if (inode.mode & INODE_MODE_ALLOC) {
-/*printf ("inode %d: %#o\n", inode.number, inode.mode);*/
-			last_allocated_inode = inum;
-			total_files++;
-			link_count[inum] = inode.nlink;
-			if (link_count[inum] <= 0) {
-				if (bad_link_end < &bad_link_list[LINK_LIST_SIZE])
-					*bad_link_end++ = inum;
-				else {
-					printf ("LINK COUNT TABLE OVERFLOW\n");
-				}
-			}
-			set_inode_state (inum, ((inode.mode & INODE_MODE_FMT) ==
-				INODE_MODE_FDIR) ? DSTATE : FSTATE);
-			bad_blocks = dup_blocks = 0;
-			scan_inode (&inode, ADDR, pass1, &used_blocks);
-			n = inode_state (inum);
-			if (n == DSTATE || n == FSTATE) {
-				if ((inode.mode & INODE_MODE_FMT) == INODE_MODE_FDIR &&
-				    (inode.size % 16) != 0) {
-					printf ("DIRECTORY MISALIGNED I=%u\n\n",
-						inode.number);
-				}
-			}
-		}
-		else if (inode.mode != 0) {
-			printf ("PARTIALLY ALLOCATED INODE I=%u\n", inum);
-			if (fs->writable)
-				u6fs_inode_clear (&inode);
-		}
-		u6fs_inode_save (&inode, 0);
+/*
+ * Store the digest after a clean check, or remove
+ * a stale one when problems were found.
+ */
+static void write_digest (u6fs_check_t *ck)
+{
+	char *name;
+	FILE *f;
+
+	name = sidecar_name (ck, ".fsck");
+	if (! name)
+		return;
+	if (ck->errors || ck->fs->modified) {
+		unlink (name);
+		free (name);
+		return;
 	}
-	if (dup_end != &dup_list[0]) {
-		printf ("** Phase 1b - Rescan For More DUPS\n");
-		for (inum = 1; inum <= last_allocated_inode; inum++) {
-			if (inode_state (inum) == USTATE)
-				continue;
-			if (! u6fs_inode_get (fs, &inode, inum))
-				continue;
-			if (scan_inode (&inode, ADDR, pass1b, 0) & STOP)
-				break;
-		}
+	f = fopen (name, "w");
+	if (! f) {
+		if (verbose)
+			perror (name);
+		free (name);
+		return;
 	}
+	fprintf (f, "u6fs-fsck %016llx %u %u %u\n", ck->digest,
+		ck->total_files, ck->used_blocks, ck->free_blocks);
+	if (fclose (f) != 0)
+		unlink (name);
+	free (name);
+}
 
-	printf ("** Phase 2 - Check Pathnames\n");
-	thisname = pathp = pathname;
-	switch (inode_state (LSXFS_ROOT_INODE)) {
+/*
+ * Header of the checkpoint file. The maps of the checker follow.
+ * The file is valid only for the same image on the same host.
+ */
+typedef struct {
+	char		magic [8];
+	unsigned int	word_size;		/* sizeof (unsigned long) */
+	unsigned short	fsize, isize;		/* geometry of the image */
+	unsigned int	fstime;			/* superblock update time */
+	long long	size, mtime;		/* image file status */
+	long		mtime_nsec;
+	int		phase;			/* phase to resume */
+	unsigned short	inum;			/* inode to resume in phase 1 */
+	unsigned short	last_allocated_inode;
+	unsigned short	total_files;
+	unsigned short	used_blocks;
+	unsigned short	lost_found_inode;
+	unsigned int	errors;
+	unsigned int	dup_pending;
+	double		phase_time [U6FS_CHECK_PHASES];
+	u6fs_iostat_t	phase_io [U6FS_CHECK_PHASES];
+	unsigned int	phase_errors [U6FS_CHECK_PHASES];
+} checkpoint_t;
+
+#define CHECKPOINT_MAGIC	"u6ckpt3"
+
+/*
+ * Fill the header fields, which identify the image.
+ */
+static int checkpoint_ident (u6fs_check_t *ck, checkpoint_t *cp)
+{
+	struct stat st;
+
+	memset (cp, 0, sizeof (*cp));
+	if (fstat (ck->fs->fd, &st) < 0)
+		return 0;
+	strcpy (cp->magic, CHECKPOINT_MAGIC);
+	cp->word_size = sizeof (unsigned long);
+	cp->fsize = ck->fs->fsize;
+	cp->isize = ck->fs->isize;
+	cp->fstime = ck->fs->time;
+	cp->size = st.st_size;
+	cp->mtime = st.st_mtime;
+	cp->mtime_nsec = U6FS_MTIME_NSEC (st);
+	return 1;
+}
+
+/*
+ * Read or write all the maps of the checker.
+ */
+static int checkpoint_maps (u6fs_check_t *ck, FILE *f, int writing)
+{
+	u6fs_t *fs = ck->fs;
+	unsigned int ninodes = fs->isize * LSXFS_INODES_PER_BLOCK;
+	struct {
+		void	*ptr;
+		size_t	size;
+	} map [] = {
+		{ ck->block_map, (fs->fsize + MAP_BITS - 1) / MAP_BITS *
+			sizeof (*ck->block_map) },
+		{ ck->state_map, (ninodes + STATES_PER_BYTE) / STATES_PER_BYTE },
+		{ ck->link_count, (ninodes + 1) * sizeof (*ck->link_count) },
+		{ ck->zero_link_map, (ninodes + 8) / 8 },
+		{ ck->dup_count, fs->fsize * sizeof (*ck->dup_count) },
+		{ ck->dup_map, (fs->fsize + 7) / 8 },
+	};
+	int i;
+
+	for (i = 0; i < sizeof (map) / sizeof (map[0]); i++) {
+		if ((writing ? fwrite (map[i].ptr, map[i].size, 1, f) :
+		    fread (map[i].ptr, map[i].size, 1, f)) != 1)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Save the state of the check, to resume it before the given
+ * phase (and inode, for phase 1) by a later run.
+ */
+static int save_checkpoint (u6fs_check_t *ck, int phase,
+	unsigned short inum, unsigned short last_allocated_inode)
+{
+	checkpoint_t cp;
+	char *name;
+	FILE *f;
+	int ok;
+
+	name = sidecar_name (ck, ".ckpt");
+	if (! name)
+		return 0;
+	f = fopen (name, "w");
+	if (! f) {
+		perror (name);
+		free (name);
+		return 0;
+	}
+	ok = checkpoint_ident (ck, &cp);
+	cp.phase = phase;
+	cp.inum = inum;
+	cp.last_allocated_inode = last_allocated_inode;
+	cp.total_files = ck->total_files;
+	cp.used_blocks = ck->used_blocks;
+	cp.lost_found_inode = ck->lost_found_inode;
+	cp.errors = ck->errors;
+	cp.dup_pending = ck->dup_pending;
+	memcpy (cp.phase_time, ck->phase_time, sizeof (cp.phase_time));
+	memcpy (cp.phase_io, ck->phase_io, sizeof (cp.phase_io));
+	memcpy (cp.phase_errors, ck->phase_errors, sizeof (cp.phase_errors));
+	ok = ok && fwrite (&cp, sizeof (cp), 1, f) == 1 &&
+		checkpoint_maps (ck, f, 1);
+	if (fclose (f) != 0)
+		ok = 0;
+	if (! ok) {
+		fprintf (stderr, "%s: cannot write checkpoint\n", name);
+		unlink (name);
+	}
+	free (name);
+	return ok;
+}
+
+/*
+ * Restore the state of the interrupted check.
+ * Return 0 when there is no valid checkpoint for this image.
+ */
+static int load_checkpoint (u6fs_check_t *ck,
+	unsigned short *last_allocated_inode)
+{
+	checkpoint_t cp, ident;
+	char *name;
+	FILE *f;
+	int ok;
+
+	name = sidecar_name (ck, ".ckpt");
+	if (! name)
+		return 0;
+	f = fopen (name, "r");
+	free (name);
+	if (! f)
+		return 0;
+	ok = checkpoint_ident (ck, &ident) &&
+		fread (&cp, sizeof (cp), 1, f) == 1 &&
+		memcmp (&cp, &ident, (char*) &cp.phase - (char*) &cp) == 0 &&
+		cp.phase >= 0 && cp.phase < U6FS_CHECK_PHASES &&
+		checkpoint_maps (ck, f, 0);
+	fclose (f);
+	if (! ok)
+		return 0;
+	ck->resume_phase = cp.phase;
+	ck->resume_inum = cp.inum;
+	*last_allocated_inode = cp.last_allocated_inode;
+	ck->total_files = cp.total_files;
+	ck->used_blocks = cp.used_blocks;
+	ck->lost_found_inode = cp.lost_found_inode;
+	ck->errors = cp.errors;
+	ck->dup_pending = cp.dup_pending;
+	memcpy (ck->phase_time, cp.phase_time, sizeof (cp.phase_time));
+	memcpy (ck->phase_io, cp.phase_io, sizeof (cp.phase_io));
+	memcpy (ck->phase_errors, cp.phase_errors, sizeof (cp.phase_errors));
+	return 1;
+}
+
+static void remove_checkpoint (u6fs_check_t *ck)
+{
+	char *name;
+
+	name = sidecar_name (ck, ".ckpt");
+	if (name) {
+		unlink (name);
+		free (name);
+	}
+}
+
+/*
+ * When the budget is exhausted, save the checkpoint
+ * and return 1: the check must stop.
+ * Never stop at the point, where this run has resumed.
+ */
+static int suspend_check (u6fs_check_t *ck, int phase, unsigned short inum,
+	unsigned short last_allocated_inode)
+{
+	struct timespec ts;
+	double t;
+
+	if (! ck->budgeted ||
+	    (phase == ck->resume_phase && inum == ck->resume_inum))
+		return 0;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	t = ts.tv_sec + ts.tv_nsec / 1e9;
+	if ((ck->budget_time <= 0 || t - ck->start_time < ck->budget_time) &&
+	    (ck->budget_io <= 0 ||
+	    ck->fs->io.read_bytes / LSXFS_BSIZE < ck->budget_io))
+		return 0;
+	if (! save_checkpoint (ck, phase, inum, last_allocated_inode))
+		return 0;
+	fprintf (ck->out, "** Budget Exhausted, Checkpoint Saved "
+		"Before Phase %s", phase_name [phase]);
+	if (phase == 0)
+		fprintf (ck->out, " I=%u", inum);
+	fprintf (ck->out, "\n");
+	return 1;
+}
+
+/*
+ * Repairs of a dry run are made in the snapshot only.
+ */
+static void prepare_dry_run (u6fs_check_t *ck)
+{
+	if (! ck->dry_run)
+		return;
+	if (ck->fs->snapshot)
+		ck->fs->writable = 1;
+	else {
+		fprintf (ck->out, "CANNOT STAGE REPAIRS, CHECK ONLY\n");
+		ck->dry_run = 0;
+	}
+}
+
+/*
+ * Compare the free list against the map of used blocks,
+ * and rebuild the list when it is corrupted.
+ */
+static void check_free_blocks (u6fs_check_t *ck, unsigned int map_words)
+{
+	u6fs_t *fs = ck->fs;
+
+	/* Blocks of cleared files are not used anymore,
+	 * and blocks of new directories are. */
+	ck->used_blocks = map_count (ck->block_map, 0, fs->fsize);
+	ck->bad_blocks = ck->dup_blocks = 0;
+	ck->free_map = calloc (map_words, sizeof (*ck->free_map));
+
+	if (! ck->free_map) {
+		fprintf (ck->out, "NO MEMORY TO CHECK FREE LIST\n");
+		ck->free_list_corrupted = 1;
+		ck->free_blocks = 0;
+	} else {
+		memcpy (ck->free_map, ck->block_map,
+			map_words * sizeof (*ck->free_map));
+		ck->free_blocks = check_free_list (ck);
+		if (verbose)
+			print_missing (ck);
+		free (ck->free_map);
+	}
+	if (ck->bad_blocks)
+		fprintf (ck->out, "%d BAD BLKS IN FREE LIST\n", ck->bad_blocks);
+	if (ck->dup_blocks)
+		fprintf (ck->out, "%d DUP BLKS IN FREE LIST\n", ck->dup_blocks);
+	if (ck->free_list_corrupted == 0) {
+		if (ck->used_blocks + ck->free_blocks != fs->fsize - fs->isize - 2) {
+			fprintf (ck->out, "%d BLK(S) MISSING\n", fs->fsize -
+				fs->isize - 2 - ck->used_blocks - ck->free_blocks);
+			ck->free_list_corrupted = 1;
+		}
+	}
+	if (ck->free_list_corrupted) {
+		fprintf (ck->out, "BAD FREE LIST\n");
+		finding (ck, "BAD FREE LIST", 0, 0, 0);
+		if (! fs->writable)
+			ck->free_list_corrupted = 0;
+	}
+
+	if (ck->free_list_corrupted) {
+		begin_phase (ck, 6, "** Phase 6 - Salvage Free List\n");
+		ck->free_blocks = make_free_list (ck);
+	}
+}
+
+/*
+ * Write all repairs, and report the result.
+ */
+static void finish_check (u6fs_check_t *ck)
+{
+	u6fs_t *fs = ck->fs;
+
+	buf_flush (ck);
+	if (fs->modified) {
+                time_t tt;
+		time (&tt);
+                fs->time = tt;
+		// time (&fs->time);
+		fs->dirty = 1;
+	}
+
+	/* Stage the superblock with other repairs, then write
+	 * them all at once, in ascending order. */
+	u6fs_sync (fs, 0);
+	if (ck->dry_run) {
+		u6fs_snapshot_diff (fs, ck->out);
+		fs->writable = 0;
+	} else if (! u6fs_snapshot_commit (fs))
+		fprintf (ck->out, "CAN NOT WRITE MODIFIED BLOCKS\n");
+	u6fs_snapshot_free (fs);
+	begin_phase (ck, -1, 0);
+	report_json (ck, 1);
+	if (fs->modified)
+		fprintf (ck->out, ck->dry_run ?
+			"\n***** FILE SYSTEM WOULD BE MODIFIED *****\n" :
+			"\n***** FILE SYSTEM WAS MODIFIED *****\n");
+}
+
+/*
+ * Phase 1 for a single inode: account it, and mark its blocks,
+ * either by scan_inode(), or by replay of the claims collected
+ * by phase 1 workers.
+ */
+static void phase1_inode (u6fs_check_t *ck, u6fs_inode_t *inode,
+	unsigned short *last_allocated_inode, phase1_t *p,
+	claim_t *claim, claim_t *end)
+{
+	unsigned short inum = inode->number;
+	int n;
+
+	if (inode->mode & INODE_MODE_ALLOC) {
+/*printf ("inode %d: %#o\n", inode->number, inode->mode);*/
+		*last_allocated_inode = inum;
+		ck->total_files++;
+		ck->link_count[inum] = inode->nlink;
+		if (ck->link_count[inum] <= 0)
+			mark_zero_link (ck, inum);
+		set_inode_state (ck, inum,
+			((inode->mode & INODE_MODE_FMT) ==
+			INODE_MODE_FDIR) ? DSTATE : FSTATE);
+		ck->bad_blocks = ck->dup_blocks = 0;
+		if (p)
+			replay_claims (ck, p, inode, claim, end);
+		else
+			scan_inode (ck, inode, ADDR, pass1, 0);
+		n = inode_state (ck, inum);
+		if (n == DSTATE || n == FSTATE) {
+			if ((inode->mode & INODE_MODE_FMT) == INODE_MODE_FDIR &&
+			    (inode->size % 16) != 0) {
+				fprintf (ck->out,
+					"DIRECTORY MISALIGNED I=%u\n\n",
+					inode->number);
+				finding (ck, "DIRECTORY MISALIGNED",
+					inum, 0, 0);
+			}
+		}
+	}
+	else if (inode->mode != 0) {
+		fprintf (ck->out, "PARTIALLY ALLOCATED INODE I=%u\n", inum);
+		finding (ck, "PARTIALLY ALLOCATED INODE", inum, 0, 0);
+		if (ck->fs->writable)
+			u6fs_inode_clear (inode);
+	}
+	u6fs_inode_save (inode, 0);
+}
+
+/*
+ * Append a block to the claims of the chunk. Blocks in range
+ * are marked busy at once; a block found busy is shared.
+ * Return 0 when the scan of the inode must stop: on too many
+ * bad blocks, like in pass1(), or when out of memory.
+ */
+static int add_claim (phase1_t *p, chunk_t *c, unsigned short blk, int ioerr)
+{
+	unsigned long *map = p->ck->block_map, old;
+	claim_t *claim;
+	unsigned int n;
+
+	if (c->nclaims >= c->size) {
+		n = c->size ? c->size * 2 : 256;
+		claim = realloc (c->claim, n * sizeof (*claim));
+		if (! claim) {
+			p->failed = 1;
+			return 0;
+		}
+		c->claim = claim;
+		c->size = n;
+	}
+	c->claim [c->nclaims].blk = blk;
+	c->claim [c->nclaims].ioerr = ioerr;
+	c->nclaims++;
+	if (ioerr)
+		return 1;
+	if (outrange (p->ck->fs, blk))
+		return ++c->bad < MAXBAD;
+	old = __sync_fetch_and_or (&map [map_word (blk)], map_bit (blk));
+	if (old & map_bit (blk))
+		__sync_fetch_and_or (&p->shared [map_word (blk)],
+			map_bit (blk));
+	return 1;
+}
+
+/*
+ * Read metadata blocks: from the snapshot, when present,
+ * else from the device without moving the seek pointer.
+ */
+static int read_meta (phase1_t *p, unsigned int bno, unsigned int count,
+	unsigned char *data, u6fs_iostat_t *io)
+{
+	u6fs_t *fs = p->ck->fs;
+	unsigned int i;
+
+	if (fs->snapshot) {
+		for (i = 0; i < count; i++)
+			if (! fs->snapshot->block [bno + i])
+				break;
+		if (i == count) {
+			for (i = 0; i < count; i++)
+				memcpy (data + i * LSXFS_BSIZE,
+					fs->snapshot->block [bno + i],
+					LSXFS_BSIZE);
+			return 1;
+		}
+	}
+	return u6fs_pread (fs, bno * 512L, data, count * LSXFS_BSIZE, io);
+}
+
+/*
+ * Collect claims of the indirect block and the blocks it refers to,
+ * in the order of scan_indirect_block().
+ */
+static int collect_indirect (phase1_t *p, chunk_t *c, unsigned short blk,
+	int double_indirect, u6fs_iostat_t *io)
+{
+	unsigned char data [LSXFS_BSIZE];
+	unsigned short nb;
+	int i, ret;
+
+	if (! add_claim (p, c, blk, 0))
+		return 0;
+	if (outrange (p->ck->fs, blk))
+		return 1;
+	if (! read_meta (p, blk, 1, data, io))
+		return add_claim (p, c, blk, 1);
+	for (i = 0; i < LSXFS_BSIZE; i+=2) {
+		nb = data [i+1] << 8 | data [i];
+		if (! nb)
+			continue;
+		if (double_indirect)
+			ret = collect_indirect (p, c, nb, 0, io);
+		else
+			ret = add_claim (p, c, nb, 0);
+		if (! ret)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Collect claims of all blocks of the inode,
+ * in the order of scan_inode().
+ */
+static void collect_inode (phase1_t *p, chunk_t *c, u6fs_inode_t *inode,
+	u6fs_iostat_t *io)
+{
+	int i;
+
+	if (((inode->mode & INODE_MODE_FMT) == INODE_MODE_FBLK) ||
+	    ((inode->mode & INODE_MODE_FMT) == INODE_MODE_FCHR))
+		return;
+	c->bad = 0;
+	if (! (inode->mode & INODE_MODE_LARG)) {
+		for (i = 0; i < 8; i++)
+			if (inode->addr[i] && ! add_claim (p, c,
+			    inode->addr[i], 0))
+				return;
+		return;
+	}
+	for (i = 0; i < 7; i++)
+		if (inode->addr[i] && ! collect_indirect (p, c,
+		    inode->addr[i], 0, io))
+			return;
+	if (inode->addr[7])
+		collect_indirect (p, c, inode->addr[7], 1, io);
+}
+
+static void collect_chunk (phase1_t *p, unsigned int i, u6fs_iostat_t *io)
+{
+	u6fs_t *fs = p->ck->fs;
+	chunk_t *c = &p->chunk [i];
+	u6fs_inode_t inode;
+	unsigned int bno, nblocks, n;
+
+	bno = i * ILIST_CHUNK;
+	nblocks = fs->isize - bno;
+	if (nblocks > ILIST_CHUNK)
+		nblocks = ILIST_CHUNK;
+	c->ninodes = nblocks * LSXFS_INODES_PER_BLOCK;
+	c->ilist = malloc (nblocks * LSXFS_BSIZE);
+	c->first = malloc ((c->ninodes + 1) * sizeof (*c->first));
+	if (! c->ilist || ! c->first) {
+		p->failed = 1;
+		return;
+	}
+	if (! read_meta (p, bno + 2, nblocks, c->ilist, io)) {
+		free (c->ilist);
+		c->ilist = 0;
+		return;
+	}
+	for (n = 0; n < c->ninodes && ! p->failed; n++) {
+		c->first [n] = c->nclaims;
+		memset (&inode, 0, sizeof (inode));
+		u6fs_inode_unpack (&inode, c->ilist + n * 32);
+		if (inode.mode & INODE_MODE_ALLOC)
+			collect_inode (p, c, &inode, io);
+	}
+	c->first [n] = c->nclaims;
+}
+
+static void *phase1_worker (void *arg)
+{
+	phase1_t *p = arg;
+	u6fs_iostat_t io;
+	unsigned int i;
+
+	memset (&io, 0, sizeof (io));
+	for (;;) {
+		i = __sync_fetch_and_add (&p->next, 1);
+		if (i >= p->nchunks || p->failed)
+			break;
+		collect_chunk (p, i, &io);
+	}
+	/* Reads are counted by every thread, and summed up here. */
+	pthread_mutex_lock (&p->lock);
+	p->ck->fs->io.reads += io.reads;
+	p->ck->fs->io.read_bytes += io.read_bytes;
+	pthread_mutex_unlock (&p->lock);
+	return 0;
+}
+
+/*
+ * Phase 1 by several threads. Every thread takes chunks of
+ * the I list, collects the blocks claimed by every inode, and
+ * marks them busy by atomic OR. A block found busy is marked
+ * shared. Then the claims are replayed in inode order, and
+ * pass1() is called for shared and bad blocks only, so that
+ * the messages and dup counts are the same as of a serial scan.
+ * Return 0 when out of memory: the block map is cleared then.
+ */
+static int phase1_parallel (u6fs_check_t *ck,
+	unsigned short *last_allocated_inode)
+{
+	u6fs_t *fs = ck->fs;
+	phase1_t p;
+	chunk_t *c;
+	u6fs_inode_t inode;
+	pthread_t *threads;
+	unsigned int map_words, i, n;
+	int nthreads;
+
+	memset (&p, 0, sizeof (p));
+	p.ck = ck;
+	p.nchunks = (fs->isize + ILIST_CHUNK - 1) / ILIST_CHUNK;
+	map_words = (fs->fsize + MAP_BITS - 1) / MAP_BITS;
+	p.chunk = calloc (p.nchunks, sizeof (*p.chunk));
+	p.shared = calloc (map_words, sizeof (*p.shared));
+	threads = calloc (ck->jobs, sizeof (*threads));
+	if (! p.chunk || ! p.shared || ! threads) {
+		p.failed = 1;
+		goto done;
+	}
+	pthread_mutex_init (&p.lock, 0);
+	for (nthreads = 0; nthreads < ck->jobs; nthreads++)
+		if (pthread_create (&threads[nthreads], 0, phase1_worker,
+		    &p) != 0)
+			break;
+	if (nthreads == 0)
+		phase1_worker (&p);
+	while (nthreads > 0)
+		pthread_join (threads[--nthreads], 0);
+	pthread_mutex_destroy (&p.lock);
+	if (p.failed) {
+		memset (ck->block_map, 0, map_words * sizeof (*ck->block_map));
+		goto done;
+	}
+
+	/* Shared blocks are marked again, in order of inodes. */
+	for (i = 0; i < map_words; i++)
+		ck->block_map [i] &= ~p.shared [i];
+	for (i = 0; i < p.nchunks; i++) {
+		c = &p.chunk [i];
+		if (! c->ilist) {
+			print_io_error (ck, "READ", i * ILIST_CHUNK + 2);
+			continue;
+		}
+		for (n = 0; n < c->ninodes; n++) {
+			memset (&inode, 0, sizeof (inode));
+			inode.fs = fs;
+			inode.number = i * ILIST_CHUNK *
+				LSXFS_INODES_PER_BLOCK + n + 1;
+			u6fs_inode_unpack (&inode, c->ilist + n * 32);
+			phase1_inode (ck, &inode, last_allocated_inode, &p,
+				c->claim + c->first [n],
+				c->claim + c->first [n+1]);
+		}
+	}
+done:
+	if (p.chunk) {
+		for (i = 0; i < p.nchunks; i++) {
+			free (p.chunk[i].ilist);
+			free (p.chunk[i].first);
+			free (p.chunk[i].claim);
+		}
+		free (p.chunk);
+	}
+	free (p.shared);
+	free (threads);
+	return ! p.failed;
+}
+
+/*
+ * Prepare a check of the filesystem.
+ * Messages are printed to the given stream.
+ */
+void u6fs_check_init (u6fs_check_t *ck, u6fs_t *fs, FILE *out)
+{
+	memset (ck, 0, sizeof (*ck));
+	ck->fs = fs;
+	ck->out = out;
+	ck->phase = -1;
+}
+
+/*
+ * Check filesystem for errors.
+ * When readonly - just check and print errors.
+ * If the system is open on read/write - fix errors.
+ */
+int u6fs_check (u6fs_check_t *ck)
+{
+	u6fs_t *fs = ck->fs;
+	u6fs_inode_t inode;
+	int n, have_digest;
+	unsigned short inum;
+	unsigned short block_map_size;		/* bytes of dup map */
+	unsigned int map_words;			/* words of block maps */
+	unsigned short last_allocated_inode;	/* hiwater mark of inodes */
+	unsigned int bno, nblocks;
+	unsigned char ilist [ILIST_CHUNK * LSXFS_BSIZE];
+
+	if (fs->isize + 2 >= fs->fsize) {
+		fprintf (ck->out, "Bad filesystem size: total %d blocks "
+			"with %d inode blocks\n",
+			fs->fsize, fs->isize);
+		return 0;
+	}
+	ck->free_list_corrupted = 0;
+	ck->total_files = 0;
+	ck->used_blocks = 0;
+	ck->dup_pending = 0;
+	ck->lost_found_inode = 0;
+	ck->lost_list = 0;
+	ck->lost_count = 0;
+	ck->buf_dirty = 0;
+	ck->buf_bno = (unsigned short) -1;
+	ck->resume_phase = 0;
+	ck->resume_inum = 1;
+	last_allocated_inode = 0;
+
+	/* Read all metadata at once. On failure, work directly
+	 * with the device. The time is accounted to phase 1.
+	 * A check with a budget reads on demand instead, so that
+	 * it can stop at any chunk of the I list. Repairs
+	 * cannot be resumed, so the budget applies to read-only
+	 * checks only. */
+	begin_phase (ck, 0, 0);
+	ck->start_time = ck->phase_start;
+	ck->budgeted = (ck->budget_time > 0 || ck->budget_io > 0) &&
+		! fs->writable;
+	if (! ck->budgeted)
+		u6fs_snapshot_load (fs);
+
+	/* Skip the check, when metadata did not change
+	 * since the last clean check. */
+	have_digest = ck->fast && u6fs_snapshot_digest (fs, &ck->digest);
+	if (have_digest && read_digest (ck)) {
+		fprintf (ck->out, "** Unchanged Since Last Check\n");
+		fprintf (ck->out, "%d files %d blocks %d free\n",
+			ck->total_files, ck->used_blocks, ck->free_blocks);
+		u6fs_snapshot_free (fs);
+		ck->skipped = 1;
+		begin_phase (ck, -1, 0);
+		report_json (ck, 1);
+		return 1;
+	}
+
+	prepare_dry_run (ck);
+
+	/* Allocate memory. */
+	block_map_size = (fs->fsize + 7) / 8;
+	map_words = (fs->fsize + MAP_BITS - 1) / MAP_BITS;
+	ck->block_map = calloc (map_words, sizeof (*ck->block_map));
+	ck->state_map = calloc ((fs->isize * LSXFS_INODES_PER_BLOCK +
+		STATES_PER_BYTE) / STATES_PER_BYTE, sizeof (*ck->state_map));
+	ck->link_count = calloc (fs->isize * LSXFS_INODES_PER_BLOCK + 1,
+		sizeof (*ck->link_count));
+	ck->zero_link_map = calloc ((fs->isize * LSXFS_INODES_PER_BLOCK + 8) /
+		8, sizeof (*ck->zero_link_map));
+	ck->dup_count = calloc (fs->fsize, sizeof (*ck->dup_count));
+	ck->dup_map = calloc (block_map_size, sizeof (*ck->dup_map));
+	ck->parent_map = calloc (fs->isize * LSXFS_INODES_PER_BLOCK + 1,
+		sizeof (*ck->parent_map));
+	if (! ck->block_map || ! ck->state_map || ! ck->link_count ||
+	    ! ck->zero_link_map || ! ck->dup_count || ! ck->dup_map ||
+	    ! ck->parent_map) {
+		fprintf (ck->out, "Cannot allocate memory\n");
+fatal:		if (ck->block_map)
+			free (ck->block_map);
+		if (ck->state_map)
+			free (ck->state_map);
+		if (ck->link_count)
+			free (ck->link_count);
+		if (ck->zero_link_map)
+			free (ck->zero_link_map);
+		if (ck->dup_count)
+			free (ck->dup_count);
+		if (ck->dup_map)
+			free (ck->dup_map);
+		if (ck->parent_map)
+			free (ck->parent_map);
+		if (ck->dry_run)
+			fs->writable = 0;
+		else
+			u6fs_snapshot_commit (fs);
+		u6fs_snapshot_free (fs);
+		begin_phase (ck, -1, 0);
+		report_json (ck, 0);
+		return 0;
+	}
+
+	/* Continue the interrupted check. */
+	if (ck->budgeted && load_checkpoint (ck, &last_allocated_inode)) {
+		fprintf (ck->out, "** Resuming From Checkpoint\n");
+		switch (ck->resume_phase) {
+		case 1: goto phase1b;
+		case 2: goto phase2;
+		case 3: goto phase3;
+		case 4: goto phase4;
+		case 5: goto phase5;
+		}
+	}
+
+	begin_phase (ck, 0, "** Phase 1 - Check Blocks and Sizes\n");
+	if (ck->jobs > 1 && ! ck->budgeted &&
+	    phase1_parallel (ck, &last_allocated_inode))
+		goto phase1_done;
+	for (inum = ck->resume_inum; inum <= fs->isize * LSXFS_INODES_PER_BLOCK;
+	    inum++) {
+		/* Read I list sequentially, by chunks of several blocks. */
+		n = (inum - 1) % (ILIST_CHUNK * LSXFS_INODES_PER_BLOCK);
+		if (n == 0) {
+			if (suspend_check (ck, 0, inum, last_allocated_inode))
+				goto suspended;
+			bno = (inum - 1) / LSXFS_INODES_PER_BLOCK;
+			nblocks = fs->isize - bno;
+			if (nblocks > ILIST_CHUNK)
+				nblocks = ILIST_CHUNK;
+			if (! u6fs_inode_list_read (fs, bno, nblocks, ilist)) {
+				print_io_error (ck, "READ", bno + 2);
+				inum += nblocks * LSXFS_INODES_PER_BLOCK - 1;
+				continue;
+			}
+		}
+		memset (&inode, 0, sizeof (inode));
+		inode.fs = fs;
+		inode.number = inum;
+		u6fs_inode_unpack (&inode, ilist + n * 32);
+		phase1_inode (ck, &inode, &last_allocated_inode, 0, 0, 0);
+	}
+phase1_done:
+	ck->used_blocks = map_count (ck->block_map, 0, fs->fsize);
+	if (suspend_check (ck, 1, 0, last_allocated_inode))
+		goto suspended;
+phase1b:
+	if (ck->dup_pending != 0) {
+		begin_phase (ck, 1, "** Phase 1b - Rescan For More DUPS\n");
+		for (inum = 1; inum <= last_allocated_inode; inum++) {
+			if (inode_state (ck, inum) == USTATE)
+				continue;
+			if (! u6fs_inode_get (fs, &inode, inum))
+				continue;
+			if (scan_inode (ck, &inode, ADDR, pass1b, 0) & STOP)
+				break;
+		}
+	}
+
+	if (suspend_check (ck, 2, 0, last_allocated_inode))
+		goto suspended;
+phase2:
+	begin_phase (ck, 2, "** Phase 2 - Check Pathnames\n");
+	ck->thisname = ck->pathp = ck->pathname;
+	switch (inode_state (ck, LSXFS_ROOT_INODE)) {
 	case USTATE:
-		printf ("ROOT INODE UNALLOCATED. TERMINATING.\n");
+		fprintf (ck->out, "ROOT INODE UNALLOCATED. TERMINATING.\n");
+		finding (ck, "ROOT INODE UNALLOCATED", LSXFS_ROOT_INODE, 0, 0);
 		goto fatal;
 	case FSTATE:
-		printf ("ROOT INODE NOT DIRECTORY\n");
+		fprintf (ck->out, "ROOT INODE NOT DIRECTORY\n");
+		finding (ck, "ROOT INODE NOT DIRECTORY", LSXFS_ROOT_INODE, 0, 0);
 		if (! fs->writable)
 			goto fatal;
 		if (! u6fs_inode_get (fs, &inode, LSXFS_ROOT_INODE))
@@ -889,119 +2196,260 @@ fatal:		if (block_map)
 		inode.mode &= ~INODE_MODE_FMT;
 		inode.mode |= INODE_MODE_FDIR;
 		u6fs_inode_save (&inode, 1);
-		set_inode_state (LSXFS_ROOT_INODE, DSTATE);
+		set_inode_state (ck, LSXFS_ROOT_INODE, DSTATE);
 	case DSTATE:
-		scan_pass2 (fs, LSXFS_ROOT_INODE);
+		scan_pass2 (ck, LSXFS_ROOT_INODE);
 		break;
 	case CLEAR:
-		printf ("DUPS/BAD IN ROOT INODE\n");
-		set_inode_state (LSXFS_ROOT_INODE, DSTATE);
-		scan_pass2 (fs, LSXFS_ROOT_INODE);
+		fprintf (ck->out, "DUPS/BAD IN ROOT INODE\n");
+		finding (ck, "DUPS/BAD IN ROOT INODE", LSXFS_ROOT_INODE, 0, 0);
+		set_inode_state (ck, LSXFS_ROOT_INODE, DSTATE);
+		scan_pass2 (ck, LSXFS_ROOT_INODE);
 	}
 
-	printf ("** Phase 3 - Check Connectivity\n");
+	if (suspend_check (ck, 3, 0, last_allocated_inode))
+		goto suspended;
+phase3:
+	begin_phase (ck, 3, "** Phase 3 - Check Connectivity\n");
+	/* Read ".." of every unreached directory, only once. */
+	ck->find_inode_name = "..";
+	for (inum = LSXFS_ROOT_INODE; inum <= last_allocated_inode; inum++) {
+		if (inode_state (ck, inum) != DSTATE ||
+		    ! u6fs_inode_get (fs, &inode, inum))
+			continue;
+		ck->find_inode_result = 0;
+		scan_inode (ck, &inode, DATA, scan_directory, find_inode);
+		ck->parent_map [inum] = ck->find_inode_result;
+	}
 	for (inum = LSXFS_ROOT_INODE; inum <= last_allocated_inode; inum++) {
-		if (inode_state (inum) == DSTATE) {
-			unsigned short ino;
+		if (inode_state (ck, inum) == DSTATE) {
+			unsigned short ino, steps;
 
-			find_inode_name = "..";
+			/* Go up while parents are unreached directories.
+			 * Stop on a cycle of ".." links. */
 			ino = inum;
-			do {
-				if (! u6fs_inode_get (fs, &inode, ino))
+			for (steps = 0; ck->parent_map [ino] != 0 &&
+			    steps < last_allocated_inode; steps++) {
+				ino = ck->parent_map [ino];
+				if (inode_state (ck, ino) != DSTATE)
 					break;
-				find_inode_result = 0;
-				scan_inode (&inode, DATA, scan_directory, find_inode);
-				if (find_inode_result == 0) {
-					/* Parent link lost. */
-					if (move_to_lost_found (&inode)) {
-						thisname = pathp = pathname;
-						*pathp++ = '?';
-						scan_pass2 (fs, ino);
-					}
-					break;
-				}
-				ino = find_inode_result;
-			} while (inode_state (ino) == DSTATE);
+			}
+			if (inode_state (ck, ino) != DSTATE ||
+			    ! u6fs_inode_get (fs, &inode, ino))
+				continue;
+
+			/* Parent link lost. */
+			if (move_to_lost_found (ck, &inode)) {
+				ck->thisname = ck->pathp = ck->pathname;
+				*ck->pathp++ = '?';
+				scan_pass2 (ck, ino);
+			}
 		}
 	}
 
-	printf ("** Phase 4 - Check Reference Counts\n");
+	if (suspend_check (ck, 4, 0, last_allocated_inode))
+		goto suspended;
+phase4:
+	begin_phase (ck, 4, "** Phase 4 - Check Reference Counts\n");
 	for (inum = LSXFS_ROOT_INODE; inum <= last_allocated_inode; inum++) {
-		switch (inode_state (inum)) {
+		switch (inode_state (ck, inum)) {
 		case FSTATE:
-			n = link_count [inum];
+			n = ck->link_count [inum];
 			if (n)
-				adjust_link_count (fs, inum, n);
-			else {
-				unsigned short *blp;
-
-				for (blp = bad_link_list; blp < bad_link_end; blp++)
-					if (*blp == inum) {
-						clear_inode (fs, inum, "UNREF");
-						break;
-					}
-			}
+				adjust_link_count (ck, inum, n);
+			else if (has_zero_link (ck, inum))
+				clear_inode (ck, inum, "UNREF");
 			break;
 		case DSTATE:
-			clear_inode (fs, inum, "UNREF");
+			clear_inode (ck, inum, "UNREF");
 			break;
 		case CLEAR:
-			clear_inode (fs, inum, "BAD/DUP");
+			clear_inode (ck, inum, "BAD/DUP");
 		}
 	}
-	buf_flush (fs);
+	flush_lost_found (ck);
+
+	if (suspend_check (ck, 5, 0, last_allocated_inode))
+		goto suspended;
+phase5:
+	begin_phase (ck, 5, "** Phase 5 - Check Free List\n");
+	free (ck->link_count);
+	free (ck->zero_link_map);
+	free (ck->dup_count);
+	free (ck->dup_map);
+	free (ck->parent_map);
+	check_free_inode_list (ck);
+	free (ck->state_map);
+	check_free_blocks (ck, map_words);
+
+	fprintf (ck->out, "%d files %d blocks %d free\n",
+		ck->total_files, ck->used_blocks, ck->free_blocks);
+	finish_check (ck);
+	if (have_digest && ! ck->dry_run)
+		write_digest (ck);
+	if (ck->budgeted)
+		remove_checkpoint (ck);
+
+	free (ck->block_map);
+	return 1;
 
-	printf ("** Phase 5 - Check Free List\n");
-	free (link_count);
-	check_free_inode_list (fs);
-	free (state_map);
-	bad_blocks = dup_blocks = 0;
-	free_map = calloc (block_map_size, sizeof (*free_map));
-	if (! free_map) {
-		printf ("NO MEMORY TO CHECK FREE LIST\n");
-		free_list_corrupted = 1;
-		free_blocks = 0;
-	} else {
-		memcpy (free_map, block_map, block_map_size);
-		free_blocks = check_free_list (fs);
-		free (free_map);
-	}
-	if (bad_blocks)
-		printf ("%d BAD BLKS IN FREE LIST\n", bad_blocks);
-	if (dup_blocks)
-		printf ("%d DUP BLKS IN FREE LIST\n", dup_blocks);
-	if (free_list_corrupted == 0) {
-		if (used_blocks + free_blocks != fs->fsize - fs->isize - 2) {
-			printf ("%d BLK(S) MISSING\n", fs->fsize -
-				fs->isize - 2 - used_blocks - free_blocks);
-			free_list_corrupted = 1;
-		}
-	}
-	if (free_list_corrupted) {
-		printf ("BAD FREE LIST\n");
-		if (! fs->writable)
-			free_list_corrupted = 0;
+suspended:
+	/* The state is saved, stop until the next run. */
+	free (ck->block_map);
+	free (ck->state_map);
+	free (ck->link_count);
+	free (ck->zero_link_map);
+	free (ck->dup_count);
+	free (ck->dup_map);
+	free (ck->parent_map);
+	ck->suspended = 1;
+	begin_phase (ck, -1, 0);
+	report_json (ck, 1);
+	return 1;
+}
+
+/*
+ * Mark a block of a file as used, for the free list check.
+ * Bad and duplicate blocks are reported by full check only.
+ */
+static int mark_used (u6fs_check_t *ck, u6fs_inode_t *inode,
+	unsigned short blk, void *arg)
+{
+	if (outrange (inode->fs, blk))
+		return SKIP;
+	mark_block_busy (ck, blk);
+	return KEEPON;
+}
+
+/*
+ * Check the free list only. The map of used blocks is collected
+ * by a single sequential pass of the I list, then compared
+ * with the free chain, like in phase 5 of the full check.
+ * If the system is open on read/write - rebuild the free list.
+ */
+int u6fs_check_free (u6fs_check_t *ck)
+{
+	u6fs_t *fs = ck->fs;
+	u6fs_inode_t inode;
+	unsigned short inum;
+	unsigned int map_words, n, bno, nblocks;
+	unsigned char ilist [ILIST_CHUNK * LSXFS_BSIZE];
+
+	if (fs->isize + 2 >= fs->fsize) {
+		fprintf (ck->out, "Bad filesystem size: total %d blocks "
+			"with %d inode blocks\n",
+			fs->fsize, fs->isize);
+		return 0;
+	}
+	ck->free_list_corrupted = 0;
+	ck->total_files = 0;
+	ck->buf_dirty = 0;
+	ck->buf_bno = (unsigned short) -1;
+
+	/* Only the I list, indirect blocks and the free chain are read.
+	 * The snapshot is needed only to stage repairs of dry run. */
+	begin_phase (ck, 0, 0);
+	if (ck->dry_run)
+		u6fs_snapshot_load (fs);
+	prepare_dry_run (ck);
+
+	map_words = (fs->fsize + MAP_BITS - 1) / MAP_BITS;
+	ck->block_map = calloc (map_words, sizeof (*ck->block_map));
+	if (! ck->block_map) {
+		fprintf (ck->out, "Cannot allocate memory\n");
+		if (ck->dry_run)
+			fs->writable = 0;
+		u6fs_snapshot_free (fs);
+		begin_phase (ck, -1, 0);
+		report_json (ck, 0);
+		return 0;
 	}
 
-	if (free_list_corrupted) {
-		printf ("** Phase 6 - Salvage Free List\n");
-		free_blocks = make_free_list (fs);
+	fprintf (ck->out, "** Phase 1 - Collect Used Blocks\n");
+	for (inum = 1; inum <= fs->isize * LSXFS_INODES_PER_BLOCK; inum++) {
+		n = (inum - 1) % (ILIST_CHUNK * LSXFS_INODES_PER_BLOCK);
+		if (n == 0) {
+			bno = (inum - 1) / LSXFS_INODES_PER_BLOCK;
+			nblocks = fs->isize - bno;
+			if (nblocks > ILIST_CHUNK)
+				nblocks = ILIST_CHUNK;
+			if (! u6fs_inode_list_read (fs, bno, nblocks, ilist)) {
+				print_io_error (ck, "READ", bno + 2);
+				inum += nblocks * LSXFS_INODES_PER_BLOCK - 1;
+				continue;
+			}
+		}
+		memset (&inode, 0, sizeof (inode));
+		inode.fs = fs;
+		inode.number = inum;
+		u6fs_inode_unpack (&inode, ilist + n * 32);
+		if (inode.mode & INODE_MODE_ALLOC) {
+			ck->total_files++;
+			scan_inode (ck, &inode, ADDR, mark_used, 0);
+		}
 	}
+	ck->used_blocks = map_count (ck->block_map, 0, fs->fsize);
 
-	printf ("%d files %d blocks %d free\n",
-		total_files, used_blocks, free_blocks);
-	if (fs->modified) {
-                time_t tt;
-		time (&tt);
-                fs->time = tt;
-		// time (&fs->time);
-		fs->dirty = 1;
+	begin_phase (ck, 5, "** Phase 5 - Check Free List\n");
+	check_free_blocks (ck, map_words);
+
+	fprintf (ck->out, "%d files %d blocks %d free\n",
+		ck->total_files, ck->used_blocks, ck->free_blocks);
+	finish_check (ck);
+	free (ck->block_map);
+	return 1;
+}
+
+/*
+ * Check the cache of free inodes in the superblock only.
+ * Every cached inode is read and must be unallocated.
+ * If the system is open on read/write - truncate the cache.
+ */
+int u6fs_check_icache (u6fs_check_t *ck)
+{
+	u6fs_t *fs = ck->fs;
+	u6fs_inode_t inode;
+	unsigned short inum;
+	int i;
+
+	ck->buf_dirty = 0;
+	ck->buf_bno = (unsigned short) -1;
+
+	/* The snapshot is needed only to stage repairs of dry run. */
+	begin_phase (ck, 0, 0);
+	if (ck->dry_run)
+		u6fs_snapshot_load (fs);
+	prepare_dry_run (ck);
+
+	ck->state_map = calloc ((fs->isize * LSXFS_INODES_PER_BLOCK +
+		STATES_PER_BYTE) / STATES_PER_BYTE, sizeof (*ck->state_map));
+	if (! ck->state_map) {
+		fprintf (ck->out, "Cannot allocate memory\n");
+		if (ck->dry_run)
+			fs->writable = 0;
+		u6fs_snapshot_free (fs);
+		begin_phase (ck, -1, 0);
+		report_json (ck, 0);
+		return 0;
 	}
-	buf_flush (fs);
-	u6fs_sync (fs, 0);
-	if (fs->modified)
-		printf ("\n***** FILE SYSTEM WAS MODIFIED *****\n");
 
-	free (block_map);
+	begin_phase (ck, 5, "** Phase 5 - Check Free Inode List\n");
+	for (i=0; i<fs->ninode; i++) {
+		inum = fs->inode[i];
+		if (inum == 0 || inum > fs->isize * LSXFS_INODES_PER_BLOCK)
+			continue;
+		if (! u6fs_inode_get (fs, &inode, inum)) {
+			print_io_error (ck, "READ",
+				(inum + 31) / LSXFS_INODES_PER_BLOCK);
+			continue;
+		}
+		if (inode.mode & INODE_MODE_ALLOC)
+			set_inode_state (ck, inum, FSTATE);
+	}
+	check_free_inode_list (ck);
+	free (ck->state_map);
+
+	fprintf (ck->out, "%d free inodes cached\n", fs->ninode);
+	finish_check (ck);
 	return 1;
 }
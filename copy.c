@@ -0,0 +1,246 @@
+/*
+ * Copy files between two unix v6 filesystems.
+ *
+ * Copyright (C) 2006 Serge Vakulenko, <vak@cronyx.ru>
+ *
+ * This file is part of BKUNIX project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "u6fs.h"
+
+extern int verbose;
+
+#define COPY_RUN	64	/* max blocks transferred at once */
+
+typedef struct {
+	u6fs_t		*to;
+	char		**names;	/* names of copied inodes, by number */
+	int		failed;		/* some file was not copied */
+	unsigned char	data [COPY_RUN * LSXFS_BSIZE];
+} copy_t;
+
+/*
+ * Set owner, mode and times of the target inode.
+ */
+static void copy_attributes (u6fs_inode_t *to, u6fs_inode_t *from)
+{
+	to->mode = (to->mode & ~07777) | (from->mode & 07777);
+	to->uid = from->uid;
+	to->gid = from->gid;
+	to->atime = from->atime;
+	to->mtime = from->mtime;
+	u6fs_inode_save_times (to, 1);
+}
+
+/*
+ * Count successive blocks, contiguous in the list.
+ */
+static unsigned int run_length (unsigned short *list, unsigned int nblocks)
+{
+	unsigned int n;
+
+	for (n = 1; n < nblocks && n < COPY_RUN; n++)
+		if (list[n] != list[0] + n || list[0] == 0)
+			break;
+	return n;
+}
+
+/*
+ * Copy data of a regular file. All the target blocks are allocated
+ * at once, then data are moved by runs of contiguous blocks.
+ */
+static int copy_data (copy_t *c, u6fs_inode_t *to, u6fs_inode_t *from)
+{
+	unsigned short *src, *dst;
+	unsigned int nblocks, lbn, n, k;
+	int ok = 0;
+
+	nblocks = (from->size + LSXFS_BSIZE - 1) / LSXFS_BSIZE;
+	src = malloc (nblocks * sizeof (*src) + 1);
+	dst = malloc (nblocks * sizeof (*dst) + 1);
+	if (! src || ! dst)
+		goto done;
+	if (! u6fs_inode_blocks (from, src, nblocks)) {
+		fprintf (stderr, "inode %d: cannot read block list\n",
+			from->number);
+		goto done;
+	}
+	if (! u6fs_inode_alloc_blocks (to, dst, nblocks)) {
+		fprintf (stderr, "inode %d: no space for %u blocks\n",
+			to->number, nblocks);
+		goto done;
+	}
+	for (lbn = 0; lbn < nblocks; lbn += n) {
+		/* Read a run of source blocks. */
+		n = run_length (src + lbn, nblocks - lbn);
+		if (src [lbn] == 0)
+			memset (c->data, 0, n * LSXFS_BSIZE);
+		else if (! u6fs_seek (from->fs, src [lbn] * 512L) ||
+		    ! u6fs_read (from->fs, c->data, n * LSXFS_BSIZE)) {
+			fprintf (stderr, "inode %d: read error at block %d\n",
+				from->number, src [lbn]);
+			goto done;
+		}
+		/* Write it by runs of target blocks. */
+		for (k = 0; k < n; k += run_length (dst + lbn + k, n - k)) {
+			if (! u6fs_seek (to->fs, dst [lbn + k] * 512L) ||
+			    ! u6fs_write (to->fs, c->data + k * LSXFS_BSIZE,
+			    run_length (dst + lbn + k, n - k) * LSXFS_BSIZE)) {
+				fprintf (stderr, "inode %d: write error at block %d\n",
+					to->number, dst [lbn + k]);
+				goto done;
+			}
+		}
+	}
+	to->fs->modified = 1;
+	ok = 1;
+done:
+	if (ok)
+		to->size = from->size;
+	else
+		u6fs_inode_truncate (to);	/* no partial contents */
+	to->dirty = 1;
+	free (src);
+	free (dst);
+	return ok;
+}
+
+/*
+ * Copy a single inode to the given path.
+ * A file, which data could not be copied, is removed.
+ */
+static void copy_inode (copy_t *c, u6fs_inode_t *from, char *path)
+{
+	u6fs_inode_t inode, dir;
+	int fmt = from->mode & INODE_MODE_FMT;
+
+	if (verbose)
+		printf ("%s\n", path);
+	u6fs_directory_parents (c->to, path);
+
+	if (fmt == INODE_MODE_FDIR) {
+		if (! u6fs_inode_by_name (c->to, &inode, path, 0, 0) &&
+		    ! u6fs_directory_create (c->to, path, from->mode))
+			c->failed = 1;
+		return;
+	}
+	if (fmt == 0 && from->nlink > 1 && c->names [from->number]) {
+		/* Hard link to a file already copied. */
+		if (! u6fs_inode_by_name (c->to, &inode,
+		    c->names [from->number], 0, 0) ||
+		    u6fs_inode_by_name (c->to, &dir, path, 0, 0) ||
+		    ! u6fs_inode_by_name (c->to, &dir, path, 3,
+		    inode.number)) {
+			fprintf (stderr, "%s: link failed\n", path);
+			c->failed = 1;
+			return;
+		}
+		++inode.nlink;
+		u6fs_inode_save_times (&inode, 1);
+		return;
+	}
+	if (! u6fs_inode_by_name (c->to, &inode, path, 1, from->mode)) {
+		fprintf (stderr, "%s: cannot create\n", path);
+		c->failed = 1;
+		return;
+	}
+	if ((inode.mode & INODE_MODE_FMT) != fmt) {
+		fprintf (stderr, "%s: file type mismatch\n", path);
+		c->failed = 1;
+		return;
+	}
+	if (fmt == INODE_MODE_FCHR || fmt == INODE_MODE_FBLK) {
+		/* Device node - major:minor in the first address. */
+		inode.addr[0] = from->addr[0];
+	} else {
+		u6fs_inode_truncate (&inode);
+		if (! copy_data (c, &inode, from)) {
+			/* Do not leave an empty file under the name. */
+			u6fs_inode_save (&inode, 0);
+			if (u6fs_inode_by_name (c->to, &inode, path, 2, 0))
+				u6fs_inode_save (&inode, 0);
+			fprintf (stderr, "%s: not copied\n", path);
+			c->failed = 1;
+			return;
+		}
+	}
+	copy_attributes (&inode, from);
+	if (fmt == 0 && from->nlink > 1)
+		c->names [from->number] = strdup (path);
+}
+
+static void copier (u6fs_inode_t *dir, u6fs_inode_t *inode,
+	char *dirname, char *filename, void *arg)
+{
+	copy_t *c = arg;
+	u6fs_inode_t target;
+	char *path;
+
+	path = alloca (strlen (dirname) + strlen (filename) + 2);
+	strcpy (path, dirname);
+	strcat (path, "/");
+	strcat (path, filename);
+
+	copy_inode (c, inode, path);
+	if ((inode->mode & INODE_MODE_FMT) == INODE_MODE_FDIR) {
+		/* Copy subdirectory, then fix it's times. */
+		u6fs_directory_scan (inode, path, copier, arg);
+		if (u6fs_inode_by_name (c->to, &target, path, 0, 0))
+			copy_attributes (&target, inode);
+	}
+}
+
+/*
+ * Copy a file or a directory tree with the given name
+ * from one filesystem to another, under the same name.
+ * Return 0 when some file could not be copied.
+ */
+int u6fs_copy (u6fs_t *to, u6fs_t *from, char *name)
+{
+	copy_t *c;
+	u6fs_inode_t inode;
+	unsigned int i;
+	char *path, *p;
+	int ok;
+
+	if (! u6fs_inode_by_name (from, &inode, name, 0, 0)) {
+		fprintf (stderr, "%s: not found\n", name);
+		return 0;
+	}
+	c = calloc (1, sizeof (*c));
+	if (! c)
+		return 0;
+	c->to = to;
+	c->names = calloc (from->isize * LSXFS_INODES_PER_BLOCK + 1,
+		sizeof (*c->names));
+	if (! c->names) {
+		free (c);
+		return 0;
+	}
+
+	/* Make the name absolute, without trailing slashes. */
+	path = alloca (strlen (name) + 2);
+	strcpy (path, "/");
+	strcat (path, name);
+	while (path[1] == '/')
+		memmove (path, path+1, strlen (path));
+	for (p = path + strlen (path) - 1; p > path && *p == '/'; p--)
+		*p = 0;
+
+	if (path[1] == 0)
+		u6fs_directory_scan (&inode, "", copier, c);
+	else
+		copier (0, &inode, "", path+1, c);
+
+	for (i=0; i <= from->isize * LSXFS_INODES_PER_BLOCK; i++)
+		if (c->names [i])
+			free (c->names [i]);
+	free (c->names);
+	ok = ! c->failed;
+	free (c);
+	return u6fs_sync (to, 0) && ok;
+}
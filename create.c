@@ -164,7 +164,8 @@ static int create_root_directory (u6fs_t *fs)
 	return 1;
 }
 
-int u6fs_create (u6fs_t *fs, const char *filename, unsigned int bytes)
+int u6fs_create (u6fs_t *fs, const char *filename, unsigned int bytes,
+	int flat)
 {
 	int n;
 	unsigned char buf [512];
@@ -172,6 +173,7 @@ int u6fs_create (u6fs_t *fs, const char *filename, unsigned int bytes)
 	memset (fs, 0, sizeof (*fs));
 	fs->filename = filename;
 	fs->seek = 0;
+	fs->flat = flat;
 
 	fs->fd = open (fs->filename, O_CREAT | O_TRUNC | O_RDWR, 0666);
 	if (fs->fd < 0)
@@ -0,0 +1,341 @@
+/*
+ * Search of file names for unix v6 filesystem.
+ *
+ * Copyright (C) 2006 Serge Vakulenko, <vak@cronyx.ru>
+ *
+ * This file is part of BKUNIX project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include "u6fs.h"
+
+extern int verbose;
+
+typedef struct {
+	unsigned short	inum;		/* directory inode */
+	char		*path;		/* name of directory, "" for root */
+} find_dir_t;
+
+/*
+ * Directories to scan, owned by one thread. The owner takes
+ * the newest entry, other threads steal the oldest one,
+ * which usually has the biggest subtree.
+ */
+typedef struct {
+	find_dir_t	*dir;
+	unsigned int	first, last, size;
+	pthread_mutex_t	lock;
+} find_queue_t;
+
+typedef struct {
+	u6fs_t		*fs;
+	const char	*pattern;
+	int		flags;		/* for fnmatch() */
+	int		bypath;		/* match whole path, not name */
+	FILE		*out;
+	unsigned int	ninodes;
+	unsigned char	*entered;	/* directory queued, by inode */
+	find_queue_t	*queue;		/* one per thread */
+	int		nthreads;
+	unsigned int	queued;		/* directories not taken yet */
+	unsigned int	pending;	/* directories not scanned yet */
+	unsigned int	nfound;
+	int		failed;
+	pthread_mutex_t	lock;		/* of counters and output */
+	pthread_cond_t	wake;
+} find_t;
+
+typedef struct {
+	find_t		*f;
+	int		self;		/* index of own queue */
+} find_worker_t;
+
+/*
+ * Return the raw inode from the I list of the snapshot.
+ */
+static unsigned char *raw_inode (u6fs_t *fs, unsigned int inum)
+{
+	unsigned char *data;
+
+	data = fs->snapshot->block [(inum + 31) / 16];
+	return data ? data + (inum + 31) % 16 * 32 : 0;
+}
+
+/*
+ * Add a directory to the queue of the thread.
+ */
+static int push_dir (find_t *f, int self, unsigned short inum, char *path)
+{
+	find_queue_t *q = &f->queue [self];
+	find_dir_t *dir;
+	unsigned int n;
+
+	pthread_mutex_lock (&q->lock);
+	if (q->last >= q->size) {
+		if (q->first > 0) {
+			memmove (q->dir, q->dir + q->first,
+				(q->last - q->first) * sizeof (*q->dir));
+			q->last -= q->first;
+			q->first = 0;
+		} else {
+			n = q->size ? q->size * 2 : 64;
+			dir = realloc (q->dir, n * sizeof (*dir));
+			if (! dir) {
+				pthread_mutex_unlock (&q->lock);
+				return 0;
+			}
+			q->dir = dir;
+			q->size = n;
+		}
+	}
+	q->dir [q->last].inum = inum;
+	q->dir [q->last].path = path;
+	q->last++;
+
+	/* Counted under the queue lock, so that 'queued'
+	 * is never less than the directories in queues. */
+	pthread_mutex_lock (&f->lock);
+	f->queued++;
+	f->pending++;
+	pthread_cond_signal (&f->wake);
+	pthread_mutex_unlock (&f->lock);
+	pthread_mutex_unlock (&q->lock);
+	return 1;
+}
+
+/*
+ * Take the newest directory of own queue, or steal
+ * the oldest directory of another thread.
+ * Return 0 when all queues are empty.
+ */
+static int take_dir (find_t *f, int self, find_dir_t *dir)
+{
+	find_queue_t *q;
+	int i, found;
+
+	for (i = 0; i < f->nthreads; i++) {
+		q = &f->queue [(self + i) % f->nthreads];
+		pthread_mutex_lock (&q->lock);
+		found = q->first < q->last;
+		if (found) {
+			if (i == 0)
+				*dir = q->dir [--q->last];
+			else
+				*dir = q->dir [q->first++];
+			pthread_mutex_lock (&f->lock);
+			f->queued--;
+			pthread_mutex_unlock (&f->lock);
+		}
+		pthread_mutex_unlock (&q->lock);
+		if (found)
+			return 1;
+	}
+	return 0;
+}
+
+static int match (find_t *f, char *path, char *name)
+{
+	if (f->bypath)
+		return fnmatch (f->pattern, path, f->flags) == 0;
+	return fnmatch (f->pattern, name, f->flags) == 0;
+}
+
+/*
+ * Match all entries of the directory, and queue subdirectories.
+ * Inodes of entries are not fetched, only the mode is looked up
+ * in the I list, to find subdirectories.
+ */
+static void scan_dir (find_t *f, int self, find_dir_t *d)
+{
+	u6fs_t *fs = f->fs;
+	u6fs_inode_t dir;
+	unsigned char *raw, *data, *p;
+	unsigned int lbn, offset, end, inum, mode, len;
+	unsigned short bno;
+	char name [15], *path, *sub;
+
+	raw = raw_inode (fs, d->inum);
+	if (! raw)
+		return;
+	u6fs_inode_unpack (&dir, raw);
+	len = strlen (d->path);
+	path = alloca (len + 16);
+	strcpy (path, d->path);
+	path [len] = '/';
+
+	for (offset = 0; offset + 16 <= dir.size; offset = end) {
+		lbn = offset / LSXFS_BSIZE;
+		end = (lbn + 1) * LSXFS_BSIZE;
+		if (end > dir.size)
+			end = dir.size;
+		bno = u6fs_snapshot_map (fs, &dir, lbn);
+		data = bno ? fs->snapshot->block [bno] : 0;
+		if (! data) {
+			fprintf (stderr, "%s/: block %u not in snapshot\n",
+				d->path, lbn);
+			continue;
+		}
+		for (p = data; p + 16 <= data + end - offset; p += 16) {
+			inum = p[1] << 8 | p[0];
+			if (inum == 0 || inum > f->ninodes ||
+			    (p[2]=='.' && p[3]==0) ||
+			    (p[2]=='.' && p[3]=='.' && p[4]==0))
+				continue;
+			memcpy (name, p + 2, 14);
+			name [14] = 0;
+			strcpy (path + len + 1, name);
+			if (match (f, path, name)) {
+				pthread_mutex_lock (&f->lock);
+				fprintf (f->out, "%s\n", path);
+				f->nfound++;
+				pthread_mutex_unlock (&f->lock);
+			}
+			raw = raw_inode (fs, inum);
+			if (! raw)
+				continue;
+			mode = raw[1] << 8 | raw[0];
+			if (! (mode & INODE_MODE_ALLOC) ||
+			    (mode & INODE_MODE_FMT) != INODE_MODE_FDIR ||
+			    ! __sync_bool_compare_and_swap (&f->entered [inum],
+			    0, 1))
+				continue;
+			sub = strdup (path);
+			if (! sub || ! push_dir (f, self, inum, sub)) {
+				fprintf (stderr, "%s/: no memory, skipped\n",
+					path);
+				free (sub);
+				f->failed = 1;
+			}
+		}
+	}
+}
+
+static void *find_worker (void *arg)
+{
+	find_worker_t *w = arg;
+	find_t *f = w->f;
+	find_dir_t dir;
+	int done;
+
+	for (;;) {
+		if (! take_dir (f, w->self, &dir)) {
+			/* Sleep until a directory is queued,
+			 * or until all are scanned. */
+			pthread_mutex_lock (&f->lock);
+			while (f->queued == 0 && f->pending > 0)
+				pthread_cond_wait (&f->wake, &f->lock);
+			done = (f->pending == 0);
+			pthread_mutex_unlock (&f->lock);
+			if (done)
+				break;
+			continue;
+		}
+		scan_dir (f, w->self, &dir);
+		free (dir.path);
+
+		pthread_mutex_lock (&f->lock);
+		if (--f->pending == 0)
+			pthread_cond_broadcast (&f->wake);
+		pthread_mutex_unlock (&f->lock);
+	}
+	return 0;
+}
+
+/*
+ * Print paths of all files, which names match the pattern.
+ * When the pattern contains a slash, the whole path is matched,
+ * and a relative pattern is taken from the root.
+ * Directories are scanned from the snapshot by 'jobs' threads.
+ * Return the number of files found, or -1 on error.
+ */
+int u6fs_find (u6fs_t *fs, const char *pattern, int jobs, FILE *out)
+{
+	find_t f;
+	find_worker_t *w;
+	pthread_t *threads;
+	char *root, *anchored = 0;
+	int i, n;
+
+	if (! u6fs_snapshot_load (fs)) {
+		fprintf (stderr, "%s: cannot read metadata\n", fs->filename);
+		return -1;
+	}
+	if (jobs < 1)
+		jobs = 1;
+	memset (&f, 0, sizeof (f));
+	f.fs = fs;
+	f.pattern = pattern;
+	f.bypath = strchr (pattern, '/') != 0;
+	if (f.bypath && pattern[0] != '/') {
+		anchored = malloc (strlen (pattern) + 2);
+		if (! anchored) {
+			fprintf (stderr, "find: no memory\n");
+			return -1;
+		}
+		anchored[0] = '/';
+		strcpy (anchored + 1, pattern);
+		f.pattern = anchored;
+	}
+	f.flags = f.bypath ? FNM_PATHNAME : 0;
+	f.out = out;
+	f.ninodes = fs->isize * LSXFS_INODES_PER_BLOCK;
+	f.nthreads = jobs;
+	f.entered = calloc (f.ninodes + 1, 1);
+	f.queue = calloc (jobs, sizeof (*f.queue));
+	w = calloc (jobs, sizeof (*w));
+	threads = calloc (jobs, sizeof (*threads));
+	if (! f.entered || ! f.queue || ! w || ! threads) {
+		fprintf (stderr, "find: no memory\n");
+		n = -1;
+		goto done;
+	}
+	pthread_mutex_init (&f.lock, 0);
+	pthread_cond_init (&f.wake, 0);
+	for (i = 0; i < jobs; i++) {
+		pthread_mutex_init (&f.queue[i].lock, 0);
+		w[i].f = &f;
+		w[i].self = i;
+	}
+	f.entered [LSXFS_ROOT_INODE] = 1;
+	root = strdup ("");
+	if (! root || ! push_dir (&f, 0, LSXFS_ROOT_INODE, root)) {
+		fprintf (stderr, "find: no memory\n");
+		free (root);
+		f.failed = 1;
+	}
+
+	for (i = 0; i < jobs; i++) {
+		if (pthread_create (&threads[i], 0, find_worker, &w[i]) != 0) {
+			fprintf (stderr, "find: cannot create thread\n");
+			break;
+		}
+	}
+	n = i;
+	if (n == 0)
+		find_worker (&w[0]);
+	for (i = 0; i < n; i++)
+		pthread_join (threads[i], 0);
+	if (verbose)
+		fprintf (stderr, "find: %u files found, %d threads\n",
+			f.nfound, n);
+
+	for (i = 0; i < jobs; i++) {
+		free (f.queue[i].dir);
+		pthread_mutex_destroy (&f.queue[i].lock);
+	}
+	pthread_cond_destroy (&f.wake);
+	pthread_mutex_destroy (&f.lock);
+	n = f.failed ? -1 : (int) f.nfound;
+done:
+	free (anchored);
+	free (f.entered);
+	free (f.queue);
+	free (w);
+	free (threads);
+	return n;
+}
@@ -7,12 +7,20 @@
  * under the terms of the GNU General Public License (GPL).
  * See the accompanying file "COPYING" for more details.
  */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <fnmatch.h>
+#include <glob.h>
 #include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include <argp.h>
 #include "u6fs.h"
 
@@ -21,11 +29,31 @@ int extract;
 int add;
 int newfs;
 int check;
+int check_part;		/* CHECK_xxx, or 0 for full check */
 int fix;
 int flat;
+int export_tar;
+int import_tar;
+char *copy_from;
+int batch = -1;			/* U6FS_BATCH_xxx, or -1 */
+int jobs;
+int fast;
+int dry_run;
+int json;
+double budget_time;
+unsigned long budget_io;
 unsigned int bytes;
 char *boot_sector;
 char *boot_sector2;
+char **extracted;		/* host paths of extracted inodes, by number */
+char *inode_paths;		/* list of inode numbers to name */
+char *block_owners;		/* list of block numbers to describe */
+int owner_cache;		/* keep block owners in a sidecar */
+u6fs_pathmap_t *pathmap;	/* names of inodes, built on first use */
+int use_index;			/* keep metadata in a sidecar index */
+char *find_pattern;		/* names of files to search */
+char *grep_string;		/* contents of files to search */
+int du;				/* print space use */
 
 const char *argp_program_version =
 	"LSX file system information, version 1.0\n"
@@ -35,10 +63,32 @@ const char *argp_program_version =
 
 const char *argp_program_bug_address = "<vak@cronyx.ru>";
 
+#define OPT_EXPORT_TAR	256		/* long-only options */
+#define OPT_IMPORT_TAR	257
+#define OPT_COPY	258
+#define OPT_BATCH	259
+#define OPT_FAST	260
+#define OPT_DRY_RUN	261
+#define OPT_JSON	262
+#define OPT_BUDGET	263
+#define OPT_IO_BUDGET	264
+#define OPT_CHECK_FREE	265
+#define OPT_CHECK_ICACHE 266
+#define OPT_INODE_PATH	267
+#define OPT_OWNER	268
+#define OPT_OWNER_CACHE	269
+#define OPT_INDEX	270
+#define OPT_FIND	271
+#define OPT_GREP	272
+#define OPT_DU		273
+
+#define CHECK_FREE	1		/* check parts of filesystem only */
+#define CHECK_ICACHE	2
+
 struct argp_option argp_options[] = {
 	{"verbose",	'v', 0,		0,	"Print verbose information" },
 	{"add",		'a', 0,		0,	"Add files to filesystem" },
-	{"extract",	'x', 0,		0,	"Extract all files" },
+	{"extract",	'x', 0,		0,	"Extract files, all by default" },
 	{"check",	'c', 0,		0,	"Check filesystem, use -c -f to fix" },
 	{"fix",		'f', 0,		0,	"Fix bugs in filesystem" },
 	{"new",		'n', 0,		0,	"Create new filesystem, -s required" },
@@ -46,6 +96,25 @@ struct argp_option argp_options[] = {
 	{"boot",	'b', "FILE",	0,	"Boot sector, -B required if not -F" },
 	{"boot2",	'B', "FILE",	0,	"Secondary boot sector, -b required" },
 	{"flat",	'F', 0,		0,	"Flat mode, no sector remapping" },
+	{"export-tar",	OPT_EXPORT_TAR, 0, 0,	"Write all files as tar archive to stdout" },
+	{"import-tar",	OPT_IMPORT_TAR, 0, 0,	"Add files from tar archive on stdin" },
+	{"copy",	OPT_COPY, "FILE", 0,	"Copy files from another filesystem image" },
+	{"batch",	OPT_BATCH, "OP", 0,	"Run check, list, summary or usage on many images, one JSON line each" },
+	{"jobs",	'j', "NUM",	0,	"Number of parallel jobs for -c, --batch, --find or --grep" },
+	{"fast",	OPT_FAST, 0,	0,	"Skip check of image unchanged since last clean check" },
+	{"dry-run",	OPT_DRY_RUN, 0,	0,	"With -c, show the repairs as a diff, do not write" },
+	{"json",	OPT_JSON, 0,	0,	"With -c, report findings and phase costs as JSON lines" },
+	{"budget",	OPT_BUDGET, "SEC", 0,	"With -c, stop after SEC seconds, resume on next run" },
+	{"io-budget",	OPT_IO_BUDGET, "NUM", 0, "With -c, stop after reading NUM blocks, resume on next run" },
+	{"check-free",	OPT_CHECK_FREE, 0, 0,	"Check free block list only, use -f to fix" },
+	{"check-icache", OPT_CHECK_ICACHE, 0, 0, "Check cache of free inodes only, use -f to fix" },
+	{"inode-path",	OPT_INODE_PATH, "N[,N...]", 0, "Print all path names of the given inodes" },
+	{"owner",	OPT_OWNER, "N[-M],...", 0, "Print owners of the given blocks or ranges" },
+	{"owner-cache",	OPT_OWNER_CACHE, 0, 0,	"With --owner, keep the index of owners in a sidecar file" },
+	{"index",	OPT_INDEX, 0,	0,	"Read metadata from a sidecar index, rebuilt when stale" },
+	{"find",	OPT_FIND, "PATTERN", 0,	"Print paths of files with matching names, in parallel" },
+	{"grep",	OPT_GREP, "STRING", 0,	"Print path:offset of the string in all files, in parallel" },
+	{"du",		OPT_DU, 0,	0,	"Print space use: free blocks, usage by uid, gid and directory" },
 	{ 0 }
 };
 
@@ -76,6 +145,72 @@ int argp_parse_option (int key, char *arg, struct argp_state *state)
 	case 'F':
 		++flat;
 		break;
+	case OPT_EXPORT_TAR:
+		++export_tar;
+		break;
+	case OPT_IMPORT_TAR:
+		++import_tar;
+		break;
+	case OPT_COPY:
+		copy_from = arg;
+		break;
+	case OPT_BATCH:
+		if (strcmp (arg, "check") == 0)
+			batch = U6FS_BATCH_CHECK;
+		else if (strcmp (arg, "list") == 0)
+			batch = U6FS_BATCH_LIST;
+		else if (strcmp (arg, "summary") == 0)
+			batch = U6FS_BATCH_SUMMARY;
+		else if (strcmp (arg, "usage") == 0)
+			batch = U6FS_BATCH_USAGE;
+		else
+			argp_error (state, "unknown batch operation: %s", arg);
+		break;
+	case 'j':
+		jobs = strtol (arg, 0, 0);
+		break;
+	case OPT_FAST:
+		++fast;
+		break;
+	case OPT_DRY_RUN:
+		++dry_run;
+		break;
+	case OPT_JSON:
+		++json;
+		break;
+	case OPT_BUDGET:
+		budget_time = strtod (arg, 0);
+		break;
+	case OPT_IO_BUDGET:
+		budget_io = strtoul (arg, 0, 0);
+		break;
+	case OPT_CHECK_FREE:
+		check_part = CHECK_FREE;
+		break;
+	case OPT_CHECK_ICACHE:
+		check_part = CHECK_ICACHE;
+		break;
+	case OPT_INODE_PATH:
+		inode_paths = arg;
+		break;
+	case OPT_OWNER:
+		block_owners = arg;
+		break;
+	case OPT_OWNER_CACHE:
+		++owner_cache;
+		break;
+	case OPT_INDEX:
+		++use_index;
+		break;
+	case OPT_FIND:
+		find_pattern = arg;
+		break;
+	case OPT_GREP:
+		grep_string = arg;
+		break;
+	case OPT_DU:
+		++du;
+		break;
 	case 's':
 		bytes = strtol (arg, 0, 0);
 		break;
@@ -106,7 +241,7 @@ const struct argp argp_parser = {
 	argp_parse_option,
 
 	/* A description of the arguments we accept. */
-	"infile.dsk [files-to-add...]",
+	"infile.dsk [files-to-add-extract-or-copy...]",
 
 	/* Program documentation. */
 	"\nPrint LSX file system information"
@@ -198,6 +333,99 @@ void print_inode_blocks (u6fs_inode_t *inode, FILE *out)
 	fprintf (out, "\n");
 }
 
+/*
+ * Copy a byte range from one file to another.
+ * Try to do it inside the kernel, fall back to read/write.
+ */
+int copy_range (int from, off_t from_offset, int to, off_t to_offset,
+	size_t bytes)
+{
+	unsigned char data [8192];
+	ssize_t n;
+
+#ifdef __linux__
+	while (bytes > 0) {
+		n = copy_file_range (from, &from_offset, to, &to_offset,
+			bytes, 0);
+		if (n <= 0)
+			break;
+		bytes -= n;
+	}
+	if (bytes > 0 && lseek (to, to_offset, SEEK_SET) == to_offset) {
+		while (bytes > 0) {
+			n = sendfile (to, from, &from_offset, bytes);
+			if (n <= 0)
+				break;
+			to_offset += n;
+			bytes -= n;
+		}
+	}
+#endif
+	while (bytes > 0) {
+		n = bytes;
+		if (n > sizeof (data))
+			n = sizeof (data);
+		n = pread (from, data, n, from_offset);
+		if (n <= 0)
+			return 0;
+		if (pwrite (to, data, n, to_offset) != n)
+			return 0;
+		from_offset += n;
+		to_offset += n;
+		bytes -= n;
+	}
+	return 1;
+}
+
+/*
+ * In flat mode, file blocks are plain byte ranges of the image.
+ * The block list is fetched once, then every run of physically
+ * contiguous blocks is copied in one piece. Holes are written
+ * as zeros.
+ */
+int extract_flat (u6fs_inode_t *inode, int fd, char *path)
+{
+	static unsigned char zero [512];
+	unsigned short *list;
+	unsigned int lbn, next, nblocks, n;
+	int ok = 0;
+
+	nblocks = (inode->size + 511) / 512;
+	if (nblocks == 0)
+		return 1;
+	list = malloc (nblocks * sizeof (*list));
+	if (! list || ! u6fs_inode_blocks (inode, list, nblocks)) {
+		fprintf (stderr, "%s: cannot read block list\n", path);
+		goto done;
+	}
+	for (lbn = 0; lbn < nblocks; lbn = next) {
+		/* Find the end of contiguous run. */
+		for (next = lbn + 1; next < nblocks && list [lbn]; next++)
+			if (list [next] != list [lbn] + next - lbn)
+				break;
+
+		n = (next - lbn) * 512;
+		if (n > inode->size - lbn * 512)
+			n = inode->size - lbn * 512;
+		if (list [lbn] == 0) {
+			if (pwrite (fd, zero, n, lbn * 512L) != n) {
+				fprintf (stderr, "%s: write error\n", path);
+				goto done;
+			}
+			continue;
+		}
+		if (! copy_range (inode->fs->fd, list [lbn] * 512L, fd,
+		    lbn * 512L, n)) {
+			fprintf (stderr, "%s: write error\n", path);
+			goto done;
+		}
+	}
+	ok = 1;
+done:
+	free (list);
+	return ok;
+}
+
 void extract_inode (u6fs_inode_t *inode, char *path)
 {
 	int fd, n;
@@ -209,6 +437,11 @@ void extract_inode (u6fs_inode_t *inode, char *path)
 		perror (path);
 		return;
 	}
+	if (flat) {
+		extract_flat (inode, fd, path);
+		close (fd);
+		return;
+	}
 	for (offset = 0; offset < inode->size; offset += 512) {
 		n = inode->size - offset;
 		if (n > 512)
@@ -249,9 +482,451 @@ void extractor (u6fs_inode_t *dir, u6fs_inode_t *inode,
 			perror (path);
 		/* Scan subdirectory. */
 		u6fs_directory_scan (inode, path, extractor, arg);
-	} else {
-		extract_inode (inode, path);
+		return;
+	}
+	if (inode->nlink > 1 && extracted) {
+		/* Hard link: copy the data only once. */
+		if (extracted [inode->number] &&
+		    link (extracted [inode->number], path) == 0)
+			return;
+		if (! extracted [inode->number])
+			extracted [inode->number] = strdup (path);
+	}
+	extract_inode (inode, path);
+}
+
+/*
+ * Create all missing directories on the host path.
+ */
+void make_host_path (char *path)
+{
+	char *p;
+
+	for (p = strchr (path+1, '/'); p; p = strchr (p+1, '/')) {
+		*p = 0;
+		mkdir (path, 0775);
+		*p = '/';
 	}
+	mkdir (path, 0775);
+}
+
+/*
+ * Extract entries of the directory, which match the list of
+ * name patterns, one per pathname component.
+ * Only the matching subdirectories are scanned.
+ */
+void extract_matching (u6fs_inode_t *dir, char *dirname,
+	char **pattern, int npatterns)
+{
+	u6fs_inode_t file;
+	unsigned int offset, n, i, inum;
+	unsigned char data [512];
+	char name [14+1], *path;
+
+	for (offset = 0; dir->size - offset >= 16; offset += n) {
+		n = dir->size - offset;
+		if (n > 512)
+			n = 512;
+		n &= ~15;
+		if (! u6fs_inode_read (dir, offset, data, n)) {
+			fprintf (stderr, "%s: read error at offset %u\n",
+				dirname, offset);
+			return;
+		}
+		for (i = 0; i < n; i += 16) {
+			inum = data [i+1] << 8 | data [i];
+			memcpy (name, data + i + 2, 14);
+			name [14] = 0;
+			if (inum == 0 || strcmp (name, ".") == 0 ||
+			    strcmp (name, "..") == 0 ||
+			    fnmatch (pattern[0], name, FNM_PERIOD) != 0)
+				continue;
+
+			if (! u6fs_inode_get (dir->fs, &file, inum)) {
+				fprintf (stderr, "cannot scan inode %d\n", inum);
+				continue;
+			}
+			if (npatterns == 1) {
+				make_host_path (dirname);
+				extractor (dir, &file, dirname, name, stdout);
+				continue;
+			}
+			if ((file.mode & INODE_MODE_FMT) != INODE_MODE_FDIR)
+				continue;
+			path = alloca (strlen (dirname) + strlen (name) + 2);
+			strcpy (path, dirname);
+			strcat (path, "/");
+			strcat (path, name);
+			extract_matching (&file, path, pattern+1, npatterns-1);
+		}
+	}
+}
+
+/*
+ * Extract files by pathname or glob pattern, like "/usr/src/?*.c".
+ * The part of name without wildcards is looked up directly.
+ * Return 0 when the name is not found.
+ */
+int extract_path (u6fs_t *fs, char *name)
+{
+	u6fs_inode_t inode;
+	char *prefix, *rest, *p, *path;
+	char *pattern [64];
+	int npatterns;
+
+	while (*name == '/')
+		++name;
+	prefix = alloca (strlen (name) + 1);
+	strcpy (prefix, name);
+	p = prefix + strlen (prefix);
+	while (p > prefix && p[-1] == '/')
+		*--p = 0;
+
+	/* Split off the components with wildcards. */
+	rest = 0;
+	for (p = prefix; *p; ++p) {
+		if (*p == '/')
+			rest = p;
+		else if (*p == '*' || *p == '?' || *p == '[')
+			break;
+	}
+	if (! *p)
+		rest = 0;
+	else if (rest)
+		*rest++ = 0;
+	else {
+		rest = alloca (strlen (prefix) + 1);
+		strcpy (rest, prefix);
+		*prefix = 0;
+	}
+
+	if (! u6fs_inode_by_name (fs, &inode, prefix, 0, 0)) {
+		fprintf (stderr, "%s: not found\n", name);
+		return 0;
+	}
+	path = alloca (strlen (prefix) + 3);
+	strcpy (path, "./");
+	strcat (path, prefix);
+
+	if (! rest) {
+		/* No wildcards - extract a single file or subtree. */
+		p = strrchr (path, '/');
+		*p++ = 0;
+		if (! *p) {
+			u6fs_directory_scan (&inode, ".", extractor,
+				(void*) stdout);
+			return 1;
+		}
+		make_host_path (path);
+		extractor (0, &inode, path, p, stdout);
+		return 1;
+	}
+	if ((inode.mode & INODE_MODE_FMT) != INODE_MODE_FDIR) {
+		fprintf (stderr, "%s: not a directory\n", prefix);
+		return 0;
+	}
+	npatterns = 0;
+	for (p = strtok (rest, "/"); p; p = strtok (0, "/")) {
+		if (npatterns >= 64) {
+			fprintf (stderr, "%s: too many components\n", name);
+			return 0;
+		}
+		pattern [npatterns++] = p;
+	}
+	if (npatterns == 0)
+		return 1;
+	extract_matching (&inode, path, pattern, npatterns);
+	return 1;
+}
+
+/*
+ * Build the map of names on first use: only linked files need it.
+ */
+u6fs_pathmap_t *need_pathmap (u6fs_t *fs)
+{
+	static int failed;
+
+	if (! pathmap && ! failed) {
+		pathmap = malloc (sizeof (*pathmap));
+		if (! pathmap || ! u6fs_pathmap_build (pathmap, fs)) {
+			free (pathmap);
+			pathmap = 0;
+			failed = 1;
+		}
+	}
+	return pathmap;
+}
+
+/*
+ * Print other names of a linked file, after the first one.
+ */
+void print_links (u6fs_inode_t *inode, char *dirname, char *filename,
+	FILE *out)
+{
+	char first [256], path [256];
+	unsigned int link;
+
+	if (! need_pathmap (inode->fs))
+		return;
+	snprintf (path, sizeof (path), "%s/%s", dirname, filename);
+	if (! u6fs_pathmap_name (pathmap, inode->number, first,
+	    sizeof (first)) || strcmp (first, path) != 0)
+		return;
+	link = u6fs_pathmap_link (pathmap, inode->number, 0);
+	while ((link = u6fs_pathmap_link (pathmap, inode->number, link)))
+		if (u6fs_pathmap_path (pathmap, link, path, sizeof (path)))
+			fprintf (out, "    link %s\n", path);
+}
+
+/*
+ * Print all names of inodes, given as a list "N,N,...".
+ * Return 0 when some inode has no name.
+ */
+int print_inode_paths (u6fs_t *fs, char *list)
+{
+	u6fs_pathmap_t pm;
+	char path [256], *p;
+	unsigned long inum;
+	unsigned int link;
+	int found, ok = 1;
+
+	u6fs_snapshot_load (fs);
+	if (! u6fs_pathmap_build (&pm, fs)) {
+		fprintf (stderr, "%s: cannot read directories\n", fs->filename);
+		u6fs_snapshot_free (fs);
+		return 0;
+	}
+	for (p = list; *p; p++) {
+		inum = strtoul (p, &p, 0);
+		found = 0;
+		if (inum == LSXFS_ROOT_INODE) {
+			printf ("%lu /\n", inum);
+			found = 1;
+		}
+		for (link = u6fs_pathmap_link (&pm, inum, 0); link;
+		    link = u6fs_pathmap_link (&pm, inum, link)) {
+			if (u6fs_pathmap_path (&pm, link, path, sizeof (path))) {
+				printf ("%lu %s\n", inum, path);
+				found = 1;
+			}
+		}
+		if (! found) {
+			fprintf (stderr, "inode %lu: no path\n", inum);
+			ok = 0;
+		}
+		if (*p != ',')
+			break;
+	}
+	u6fs_pathmap_free (&pm);
+	u6fs_snapshot_free (fs);
+	return ok;
+}
+
+/*
+ * Print one line about a run of blocks with the same owner.
+ */
+void print_owner_run (u6fs_t *fs, u6fs_owners_t *ow, u6fs_pathmap_t *pm,
+	unsigned int from, unsigned int to)
+{
+	static char *role_name[] = { "", "data", "indirect", "double indirect" };
+	u6fs_owner_t *o = &ow->owner [from];
+	char path [256];
+
+	printf ("%u", from);
+	if (to > from)
+		printf ("-%u", to);
+	if (from == 0)
+		printf (" boot block\n");
+	else if (from == 1)
+		printf (" superblock\n");
+	else if (from < fs->isize + 2)
+		printf (" inode list I=%u-%u\n",
+			(from - 2) * LSXFS_INODES_PER_BLOCK + 1,
+			(to - 1) * LSXFS_INODES_PER_BLOCK);
+	else if (o->claims == 0)
+		printf (" not used by files\n");
+	else {
+		printf (" I=%u %s %u", o->inum, role_name [o->role], o->lbn);
+		if (to > from)
+			printf ("-%u", o->lbn + to - from);
+		if (o->claims > 1)
+			printf (" (%u owners)", o->claims);
+		if (pm && u6fs_pathmap_name (pm, o->inum, path, sizeof (path)))
+			printf (" %s", path);
+		printf ("\n");
+	}
+}
+
+/*
+ * Does the block continue the run, started at block 'start'?
+ */
+int same_owner_run (u6fs_t *fs, u6fs_owners_t *ow, unsigned int start,
+	unsigned int bno)
+{
+	u6fs_owner_t *o = &ow->owner [bno], *prev = o - 1;
+
+	if (start < 2)
+		return 0;
+	if (start < fs->isize + 2)
+		return bno < fs->isize + 2;
+	if (o->claims != prev->claims)
+		return 0;
+	if (o->claims == 0)
+		return 1;
+	return o->inum == prev->inum && o->role == U6FS_ROLE_DATA &&
+		prev->role == U6FS_ROLE_DATA && o->lbn == prev->lbn + 1;
+}
+
+/*
+ * Print owners of blocks, given as a list "N,N-M,...".
+ * Successive blocks of the same file, and unused blocks,
+ * are joined into runs. Return 0 on error.
+ */
+int print_block_owners (u6fs_t *fs, char *list)
+{
+	u6fs_owners_t ow;
+	u6fs_pathmap_t pm;
+	char *name = 0, *p;
+	unsigned long from, to, bno, start;
+	int have_paths, ok = 1;
+
+	if (owner_cache) {
+		name = alloca (strlen (fs->filename) + 8);
+		strcpy (name, fs->filename);
+		strcat (name, ".owners");
+	}
+	if (! name || ! u6fs_owners_load (&ow, fs, name)) {
+		/* One sweep of all metadata. */
+		u6fs_snapshot_load (fs);
+		if (! u6fs_owners_build (&ow, fs)) {
+			fprintf (stderr, "%s: no memory for owners\n",
+				fs->filename);
+			u6fs_snapshot_free (fs);
+			return 0;
+		}
+		if (name)
+			u6fs_owners_save (&ow, fs, name);
+	}
+	have_paths = u6fs_pathmap_build (&pm, fs);
+
+	for (p = list; *p; p++) {
+		from = to = strtoul (p, &p, 0);
+		if (*p == '-')
+			to = strtoul (p + 1, &p, 0);
+		if (from > to || to >= fs->fsize) {
+			fprintf (stderr, "block %lu: out of range\n", to);
+			ok = 0;
+		} else {
+			start = from;
+			for (bno = from + 1; bno <= to; bno++) {
+				if (same_owner_run (fs, &ow, start, bno))
+					continue;
+				print_owner_run (fs, &ow, have_paths ?
+					&pm : 0, start, bno - 1);
+				start = bno;
+			}
+			print_owner_run (fs, &ow, have_paths ? &pm : 0,
+				start, to);
+		}
+		if (*p != ',')
+			break;
+	}
+	if (have_paths)
+		u6fs_pathmap_free (&pm);
+	u6fs_owners_free (&ow);
+	u6fs_snapshot_free (fs);
+	return ok;
+}
+
+/*
+ * Load all metadata from the sidecar index of a read-only image.
+ * When the index is missing or stale, read the metadata
+ * from the image and write the index for the next run.
+ */
+void open_index (u6fs_t *fs)
+{
+	char *name;
+
+	if (! use_index || fs->writable)
+		return;
+	name = alloca (strlen (fs->filename) + 8);
+	strcpy (name, fs->filename);
+	strcat (name, ".index");
+	if (u6fs_snapshot_restore (fs, name))
+		return;
+	if (u6fs_snapshot_load (fs))
+		u6fs_snapshot_save (fs, name);
+}
+
+typedef struct {
+	char		*path;
+	unsigned short	inum;
+} dir_usage_t;
+
+static int by_path (const void *a, const void *b)
+{
+	return strcmp (((dir_usage_t*) a)->path, ((dir_usage_t*) b)->path);
+}
+
+/*
+ * Print space use of the filesystem: totals, usage
+ * by owners, and by directory subtrees, sorted by path.
+ */
+int print_usage (u6fs_t *fs)
+{
+	u6fs_usage_t u;
+	u6fs_usage_count_t *c;
+	unsigned int used, inum, ndirs = 0, k;
+	dir_usage_t *dirs;
+	char path [1024];
+
+	if (! u6fs_usage_build (&u, fs, 1)) {
+		fprintf (stderr, "%s: cannot compute usage\n", fs->filename);
+		return 0;
+	}
+	used = u.data_blocks + u.ind_blocks;
+	printf ("Volume: %u blocks, %u inode list\n", fs->fsize, fs->isize);
+	printf ("  Used: %u blocks, %u data, %u indirect (%.1f%%)\n",
+		used, u.data_blocks, u.ind_blocks,
+		used ? 100.0 * u.ind_blocks / used : 0.0);
+	printf ("  Free: %u blocks, %u in core\n", u.free_blocks, fs->nfree);
+	if (fs->fsize - fs->isize - 2 != used + u.free_blocks)
+		printf ("  Lost: %d blocks\n",
+			fs->fsize - fs->isize - 2 - used - u.free_blocks);
+	printf ("Inodes: %u, %u used, %u free\n",
+		u.ninodes, u.inodes, u.ninodes - u.inodes);
+
+	printf ("\n   uid  files blocks\n");
+	for (k = 0; k < 256; k++)
+		if (u.uid[k].files)
+			printf ("%6u %6u %6u\n", k, u.uid[k].files,
+				u.uid[k].blocks);
+	printf ("\n   gid  files blocks\n");
+	for (k = 0; k < 256; k++)
+		if (u.gid[k].files)
+			printf ("%6u %6u %6u\n", k, u.gid[k].files,
+				u.gid[k].blocks);
+
+	printf ("\nblocks  files path\n");
+	dirs = calloc (u.ninodes, sizeof (*dirs));
+	for (inum = 1; dirs && inum <= u.ninodes; inum++) {
+		if (u.tree[inum].files == 0 ||
+		    ! u6fs_pathmap_name (&u.pathmap, inum, path, sizeof (path)))
+			continue;
+		dirs [ndirs].path = strdup (path);
+		dirs [ndirs].inum = inum;
+		if (dirs [ndirs].path)
+			ndirs++;
+	}
+	qsort (dirs, ndirs, sizeof (*dirs), by_path);
+	for (k = 0; k < ndirs; k++) {
+		c = &u.tree [dirs[k].inum];
+		printf ("%6u %6u %s\n", c->blocks, c->files, dirs[k].path);
+		free (dirs[k].path);
+	}
+	free (dirs);
+	u6fs_usage_free (&u);
+	return 1;
 }
 
 void scanner (u6fs_inode_t *dir, u6fs_inode_t *inode,
@@ -261,6 +936,9 @@ void scanner (u6fs_inode_t *dir, u6fs_inode_t *inode,
 	char *path;
 
 	print_inode (inode, dirname, filename, out);
+	if (inode->nlink > 1 &&
+	    (inode->mode & INODE_MODE_FMT) != INODE_MODE_FDIR)
+		print_links (inode, dirname, filename, out);
 
 	if (verbose > 1) {
 		/* Print a list of blocks. */
@@ -285,53 +963,7 @@ void scanner (u6fs_inode_t *dir, u6fs_inode_t *inode,
  */
 void add_directory (u6fs_t *fs, char *name)
 {
-	u6fs_inode_t dir, parent;
-	char buf [512], *p;
-
-	/* Open parent directory. */
-	strcpy (buf, name);
-	p = strrchr (buf, '/');
-	if (p)
-		*p = 0;
-	else
-		*buf = 0;
-	if (! u6fs_inode_by_name (fs, &parent, buf, 0, 0)) {
-		fprintf (stderr, "%s: cannot open directory\n", buf);
-		return;
-	}
-
-	/* Create directory. */
-	if (! u6fs_inode_by_name (fs, &dir, name, 1,
-	    INODE_MODE_FDIR | 0777)) {
-		fprintf (stderr, "%s: directory inode create failed\n", name);
-		return;
-	}
-	u6fs_inode_save (&dir, 0);
-
-	/* Make link '.' */
-	strcpy (buf, name);
-	strcat (buf, "/.");
-	if (! u6fs_inode_by_name (fs, &dir, buf, 3, dir.number)) {
-		fprintf (stderr, "%s: dot link failed\n", name);
-		return;
-	}
-	++dir.nlink;
-	u6fs_inode_save (&dir, 1);
-/*printf ("*** inode %d: increment link counter to %d\n", dir.number, dir.nlink);*/
-
-	/* Make parent link '..' */
-	strcat (buf, ".");
-	if (! u6fs_inode_by_name (fs, &dir, buf, 3, parent.number)) {
-		fprintf (stderr, "%s: dotdot link failed\n", name);
-		return;
-	}
-	if (! u6fs_inode_get (fs, &parent, parent.number)) {
-		fprintf (stderr, "inode %d: cannot open parent\n", parent.number);
-		return;
-	}
-	++parent.nlink;
-	u6fs_inode_save (&parent, 1);
-/*printf ("*** inode %d: increment link counter to %d\n", parent.number, parent.nlink);*/
+	u6fs_directory_create (fs, name, 0777);
 }
 
 /*
@@ -436,23 +1068,72 @@ void add_boot (u6fs_t *fs)
 	}
 }
 
+/*
+ * Collect names of images for batch mode. Patterns are expanded
+ * by glob(), and "-" means a list of names on stdin, one per line.
+ * Return the number of images with errors.
+ */
+int run_batch (char **args, int nargs)
+{
+	glob_t g;
+	char line [1024], *p;
+	int flags = 0, failed;
+
+	memset (&g, 0, sizeof (g));
+	for (; nargs > 0; args++, nargs--) {
+		if (strcmp (*args, "-") != 0) {
+			glob (*args, flags | GLOB_NOCHECK, 0, &g);
+			flags = GLOB_APPEND;
+			continue;
+		}
+		while (fgets (line, sizeof (line), stdin)) {
+			p = line + strlen (line);
+			while (p > line && (p[-1] == '\n' || p[-1] == '\r'))
+				*--p = 0;
+			if (line[0] == 0)
+				continue;
+			glob (line, flags | GLOB_NOCHECK | GLOB_NOMAGIC,
+				0, &g);
+			flags = GLOB_APPEND;
+		}
+	}
+	if (g.gl_pathc == 0) {
+		fprintf (stderr, "batch: no images\n");
+		return 1;
+	}
+	failed = u6fs_batch (g.gl_pathv, g.gl_pathc, batch, jobs,
+		fix, fast, flat, stdout);
+	globfree (&g);
+	return failed;
+}
+
 int main (int argc, char **argv)
 {
-	int i;
+	int i, n;
 	u6fs_t fs;
 	u6fs_inode_t inode;
 
 	argp_parse (&argp_parser, argc, argv, 0, &i, 0);
-	if ((! add && i != argc-1) || (add && i >= argc-1) ||
-	    (extract + newfs + check + add > 1) ||
+	if (check_part)
+		check = 1;
+	if (jobs <= 0)
+		jobs = sysconf (_SC_NPROCESSORS_ONLN);
+	if ((! add && ! extract && ! copy_from && batch < 0 && i != argc-1) ||
+	    (add && i >= argc-1) ||
+	    (extract + newfs + check + add + export_tar + import_tar +
+	    (copy_from != 0) + (batch >= 0) + (inode_paths != 0) +
+	    (block_owners != 0) + (find_pattern != 0) +
+	    (grep_string != 0) + du > 1) ||
 	    (!flat && (! boot_sector ^ ! boot_sector2)) ||
-	    (newfs && bytes < 5120)) {
+	    (newfs && bytes < 5120) ||
+	    ((budget_time > 0 || budget_io > 0) &&
+	    (! check || fix || check_part))) {
 		argp_help (&argp_parser, stderr, ARGP_HELP_USAGE, argv[0]);
 		return -1;
 	}
 	if (newfs) {
 		/* Create new filesystem. */
-		if (! u6fs_create (&fs, argv[i], bytes)) {
+		if (! u6fs_create (&fs, argv[i], bytes, flat)) {
 			fprintf (stderr, "%s: cannot create filesystem\n", argv[i]);
 			return -1;
 		}
@@ -462,25 +1143,167 @@ int main (int argc, char **argv)
 		return 0;
 	}
 
+	if (batch >= 0) {
+		/* Process images i..argc-1 in parallel. */
+		return run_batch (argv + i, argc - i) ? 1 : 0;
+	}
+
 	if (check) {
 		/* Check filesystem for errors, and optionally fix them. */
-		if (! u6fs_open (&fs, argv[i], fix)) {
+		u6fs_check_t ck;
+
+		if (! u6fs_open (&fs, argv[i], fix && ! dry_run, flat)) {
 			fprintf (stderr, "%s: cannot open\n", argv[i]);
 			return -1;
 		}
-		u6fs_check (&fs);
+		u6fs_check_init (&ck, &fs, stdout);
+		ck.fast = fast;
+		ck.dry_run = dry_run;
+		ck.jobs = jobs;
+		ck.budget_time = budget_time;
+		ck.budget_io = budget_io;
+		if (json) {
+			/* Only the records go to stdout. */
+			ck.json = stdout;
+			ck.out = fopen ("/dev/null", "w");
+			if (! ck.out) {
+				perror ("/dev/null");
+				return -1;
+			}
+		}
+		if (check_part == CHECK_FREE)
+			u6fs_check_free (&ck);
+		else if (check_part == CHECK_ICACHE)
+			u6fs_check_icache (&ck);
+		else
+			u6fs_check (&ck);
+		if (json)
+			fclose (ck.out);
 		u6fs_close (&fs);
 		return 0;
 	}
 
+	if (inode_paths) {
+		/* Print names of inodes. */
+		if (! u6fs_open (&fs, argv[i], 0, flat)) {
+			fprintf (stderr, "%s: cannot open\n", argv[i]);
+			return -1;
+		}
+		open_index (&fs);
+		n = print_inode_paths (&fs, inode_paths);
+		u6fs_close (&fs);
+		return n ? 0 : 1;
+	}
+
+	if (block_owners) {
+		/* Print owners of blocks. */
+		if (! u6fs_open (&fs, argv[i], 0, flat)) {
+			fprintf (stderr, "%s: cannot open\n", argv[i]);
+			return -1;
+		}
+		open_index (&fs);
+		n = print_block_owners (&fs, block_owners);
+		u6fs_close (&fs);
+		return n ? 0 : 1;
+	}
+
+	if (du) {
+		/* Print space use. */
+		if (! u6fs_open (&fs, argv[i], 0, flat)) {
+			fprintf (stderr, "%s: cannot open\n", argv[i]);
+			return -1;
+		}
+		open_index (&fs);
+		n = print_usage (&fs);
+		u6fs_close (&fs);
+		return n ? 0 : 1;
+	}
+
+	if (find_pattern) {
+		/* Search file names. */
+		if (! u6fs_open (&fs, argv[i], 0, flat)) {
+			fprintf (stderr, "%s: cannot open\n", argv[i]);
+			return -1;
+		}
+		open_index (&fs);
+		n = u6fs_find (&fs, find_pattern, jobs, stdout);
+		u6fs_close (&fs);
+		return n > 0 ? 0 : 1;
+	}
+
+	if (grep_string) {
+		/* Search file contents. */
+		long hits;
+
+		if (! u6fs_open (&fs, argv[i], 0, flat)) {
+			fprintf (stderr, "%s: cannot open\n", argv[i]);
+			return -1;
+		}
+		open_index (&fs);
+		hits = u6fs_grep (&fs, grep_string, jobs, stdout);
+		u6fs_close (&fs);
+		return hits > 0 ? 0 : 1;
+	}
+
+	if (export_tar || import_tar) {
+		/* Convert filesystem to tar stream, or back. */
+		if (! u6fs_open (&fs, argv[i], import_tar, flat)) {
+			fprintf (stderr, "%s: cannot open\n", argv[i]);
+			return -1;
+		}
+		if (export_tar ? ! u6fs_tar_export (&fs, stdout) :
+		    ! u6fs_tar_import (&fs, stdin)) {
+			fprintf (stderr, "%s: tar %s failed\n", argv[i],
+				export_tar ? "export" : "import");
+			u6fs_close (&fs);
+			return -1;
+		}
+		u6fs_close (&fs);
+		return 0;
+	}
+
+	if (copy_from) {
+		/* Copy files i+1..argc-1 from another image, or all. */
+		u6fs_t from;
+
+		if (! u6fs_open (&from, copy_from, 0, flat)) {
+			fprintf (stderr, "%s: cannot open\n", copy_from);
+			return -1;
+		}
+		if (! u6fs_open (&fs, argv[i], 1, flat)) {
+			fprintf (stderr, "%s: cannot open\n", argv[i]);
+			return -1;
+		}
+		n = 0;
+		if (i == argc-1 && ! u6fs_copy (&fs, &from, "/"))
+			n = 1;
+		while (++i < argc)
+			if (! u6fs_copy (&fs, &from, argv[i]))
+				n = 1;
+		u6fs_close (&fs);
+		u6fs_close (&from);
+		return n;
+	}
+
 	/* Add or extract or info or boot update. */
 	if (! u6fs_open (&fs, argv[i],
-			(add != 0) || (boot_sector && boot_sector2))) {
+			(add != 0) || (boot_sector && boot_sector2), flat)) {
 		fprintf (stderr, "%s: cannot open\n", argv[i]);
 		return -1;
 	}
 
 	if (extract) {
+		extracted = calloc (fs.isize * LSXFS_INODES_PER_BLOCK + 1,
+			sizeof (*extracted));
+		if (i < argc-1) {
+			/* Extract given files i+1..argc-1. */
+			n = 1;
+			while (++i < argc)
+				if (! extract_path (&fs, argv[i]))
+					n = 0;
+			u6fs_close (&fs);
+			return n ? 0 : 1;
+		}
 		/* Extract all files to current directory. */
 		if (! u6fs_inode_get (&fs, &inode, 1)) {
 			fprintf (stderr, "%s: cannot get inode 1\n", argv[i]);
@@ -505,6 +1328,7 @@ int main (int argc, char **argv)
 	/* Print the structure of flesystem. */
 	u6fs_print (&fs, stdout);
 	if (verbose) {
+		open_index (&fs);
 		printf ("--------\n");
 		if (! u6fs_inode_get (&fs, &inode, 1)) {
 			fprintf (stderr, "%s: cannot get inode 1\n", argv[i]);
@@ -516,7 +1340,12 @@ int main (int argc, char **argv)
 			printf ("/\n");
 			print_inode_blocks (&inode, stdout);
 		}
+		/* Other names of linked files are shown once. */
 		u6fs_directory_scan (&inode, "", scanner, (void*) stdout);
+		if (pathmap) {
+			u6fs_pathmap_free (pathmap);
+			free (pathmap);
+		}
 	}
 	u6fs_close (&fs);
 	return 0;
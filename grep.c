@@ -0,0 +1,255 @@
+/*
+ * Search of file contents for unix v6 filesystem.
+ *
+ * Copyright (C) 2006 Serge Vakulenko, <vak@cronyx.ru>
+ *
+ * This file is part of BKUNIX project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "u6fs.h"
+
+extern int verbose;
+
+#define GREP_RUN	64	/* max blocks read at once */
+
+typedef struct {
+	u6fs_inode_t	inode;
+	unsigned short	first;		/* first data block */
+	char		*path;
+} grep_file_t;
+
+typedef struct {
+	u6fs_t		*fs;
+	const char	*pattern;
+	unsigned int	patlen;
+	FILE		*out;
+	grep_file_t	*file;		/* in order of first block */
+	unsigned int	nfiles;
+	unsigned int	next;		/* next file to search */
+	unsigned long	nhits;
+	int		failed;
+	pthread_mutex_t	lock;		/* of output, counters and fs->io */
+} grep_t;
+
+static int by_first_block (const void *a, const void *b)
+{
+	const grep_file_t *x = a, *y = b;
+
+	return (int) x->first - (int) y->first;
+}
+
+/*
+ * Read a run of physically adjacent blocks of the file,
+ * starting from logical block lbn. Holes are read as zeros.
+ * Return the number of blocks, or 0 on error.
+ */
+static unsigned int read_run (grep_t *g, grep_file_t *f, unsigned int lbn,
+	unsigned int nblocks, unsigned char *data, u6fs_iostat_t *io)
+{
+	unsigned short bno;
+	unsigned int n;
+
+	bno = u6fs_snapshot_map (g->fs, &f->inode, lbn);
+	if (bno == 0) {
+		memset (data, 0, LSXFS_BSIZE);
+		return 1;
+	}
+	for (n = 1; n < nblocks && n < GREP_RUN; n++)
+		if (u6fs_snapshot_map (g->fs, &f->inode, lbn + n) != bno + n)
+			break;
+	if (! u6fs_pread (g->fs, bno * 512L, data, n * LSXFS_BSIZE, io)) {
+		fprintf (stderr, "%s: read error at block %u\n", f->path, bno);
+		return 0;
+	}
+	return n;
+}
+
+/*
+ * Stream the file through memmem(), keeping the tail
+ * of the previous run, to find strings across runs.
+ * Hits are collected, and printed together.
+ */
+static void grep_file (grep_t *g, grep_file_t *f, unsigned char *buf,
+	u6fs_iostat_t *io)
+{
+	unsigned char *data = buf + g->patlen - 1, *start, *end, *p;
+	unsigned int nblocks, lbn, n, keep = 0;
+	unsigned long offset = 0, nhits = 0;
+	char *hits = 0;
+	size_t len = 0;
+	FILE *out;
+
+	out = open_memstream (&hits, &len);
+	if (! out)
+		return;
+	nblocks = (f->inode.size + LSXFS_BSIZE - 1) / LSXFS_BSIZE;
+	for (lbn = 0; lbn < nblocks; lbn += n) {
+		n = read_run (g, f, lbn, nblocks - lbn, data, io);
+		if (n == 0) {
+			g->failed = 1;
+			break;
+		}
+		start = data - keep;
+		end = data + n * LSXFS_BSIZE;
+		if (lbn + n == nblocks)
+			end = data + (f->inode.size - lbn * LSXFS_BSIZE);
+		for (p = start; (p = memmem (p, end - p, g->pattern,
+		    g->patlen)); p++) {
+			fprintf (out, "%s:%lu\n", f->path, offset + (p - data));
+			nhits++;
+		}
+		offset += n * LSXFS_BSIZE;
+
+		/* Keep the tail, which may start a string. */
+		keep = g->patlen - 1;
+		if (keep > (unsigned int) (end - start))
+			keep = end - start;
+		memmove (data - keep, end - keep, keep);
+	}
+	fclose (out);
+	pthread_mutex_lock (&g->lock);
+	fwrite (hits, 1, len, g->out);
+	g->nhits += nhits;
+	pthread_mutex_unlock (&g->lock);
+	free (hits);
+}
+
+static void *grep_worker (void *arg)
+{
+	grep_t *g = arg;
+	u6fs_iostat_t io;
+	unsigned char *buf;
+	unsigned int i;
+
+	memset (&io, 0, sizeof (io));
+	buf = malloc (g->patlen + GREP_RUN * LSXFS_BSIZE);
+	if (! buf) {
+		fprintf (stderr, "grep: no memory\n");
+		return 0;
+	}
+	for (;;) {
+		i = __sync_fetch_and_add (&g->next, 1);
+		if (i >= g->nfiles)
+			break;
+		grep_file (g, &g->file [i], buf, &io);
+	}
+	free (buf);
+
+	/* Reads are counted by every thread, and summed up here. */
+	pthread_mutex_lock (&g->lock);
+	g->fs->io.reads += io.reads;
+	g->fs->io.read_bytes += io.read_bytes;
+	pthread_mutex_unlock (&g->lock);
+	return 0;
+}
+
+/*
+ * Make the list of regular files with their paths.
+ * The I list is taken from the snapshot.
+ */
+static int collect_files (grep_t *g, u6fs_pathmap_t *pm)
+{
+	u6fs_t *fs = g->fs;
+	grep_file_t *f;
+	unsigned int inum, ninodes;
+	unsigned char *data;
+	char path [1024];
+
+	ninodes = fs->isize * LSXFS_INODES_PER_BLOCK;
+	g->file = calloc (ninodes, sizeof (*g->file));
+	if (! g->file)
+		return 0;
+	for (inum = 1; inum <= ninodes; inum++) {
+		data = u6fs_snapshot_block (fs, (inum + 31) / 16);
+		if (! data)
+			continue;
+		f = &g->file [g->nfiles];
+		u6fs_inode_unpack (&f->inode, data + (inum + 31) % 16 * 32);
+		if (! (f->inode.mode & INODE_MODE_ALLOC) ||
+		    (f->inode.mode & INODE_MODE_FMT) != 0 ||
+		    f->inode.size == 0 ||
+		    ! u6fs_pathmap_name (pm, inum, path, sizeof (path)))
+			continue;
+		f->inode.fs = fs;
+		f->inode.number = inum;
+		f->first = u6fs_snapshot_map (fs, &f->inode, 0);
+		f->path = strdup (path);
+		if (! f->path)
+			return 0;
+		g->nfiles++;
+	}
+	return 1;
+}
+
+/*
+ * Print path and offset of every occurrence of the string
+ * in all regular files. Files are searched by 'jobs' threads,
+ * taken in order of their first block, so that the image
+ * is read mostly in ascending order.
+ * Return the number of hits, or -1 on error.
+ */
+long u6fs_grep (u6fs_t *fs, const char *pattern, int jobs, FILE *out)
+{
+	grep_t g;
+	u6fs_pathmap_t pm;
+	pthread_t *threads;
+	unsigned int i;
+	int n;
+
+	memset (&g, 0, sizeof (g));
+	g.fs = fs;
+	g.pattern = pattern;
+	g.patlen = strlen (pattern);
+	g.out = out;
+	if (g.patlen == 0)
+		return 0;
+	if (! u6fs_snapshot_load (fs) || ! u6fs_pathmap_build (&pm, fs)) {
+		fprintf (stderr, "%s: cannot read metadata\n", fs->filename);
+		return -1;
+	}
+	if (! collect_files (&g, &pm)) {
+		fprintf (stderr, "grep: no memory\n");
+		g.failed = 1;
+		goto done;
+	}
+	qsort (g.file, g.nfiles, sizeof (*g.file), by_first_block);
+
+	if (jobs < 1)
+		jobs = 1;
+	if (jobs > g.nfiles)
+		jobs = g.nfiles;
+	threads = calloc (jobs, sizeof (*threads));
+	if (! threads)
+		jobs = 0;
+	pthread_mutex_init (&g.lock, 0);
+	for (n = 0; n < jobs; n++) {
+		if (pthread_create (&threads[n], 0, grep_worker, &g) != 0) {
+			fprintf (stderr, "grep: cannot create thread\n");
+			break;
+		}
+	}
+	jobs = n;
+	if (jobs == 0)
+		grep_worker (&g);
+	for (n = 0; n < jobs; n++)
+		pthread_join (threads[n], 0);
+	pthread_mutex_destroy (&g.lock);
+	free (threads);
+	if (verbose)
+		fprintf (stderr, "grep: %lu hits in %u files, %d threads\n",
+			g.nhits, g.nfiles, jobs);
+done:
+	if (g.file) {
+		for (i = 0; i < g.nfiles; i++)
+			free (g.file[i].path);
+		free (g.file);
+	}
+	u6fs_pathmap_free (&pm);
+	return g.failed ? -1 : g.nhits;
+}
@@ -16,16 +16,65 @@
 
 extern int verbose;
 
+/*
+ * Convert inode from raw data, 32 bytes.
+ */
+void u6fs_inode_unpack (u6fs_inode_t *inode, unsigned char *data)
+{
+	int i;
+
+	inode->mode = data[1] << 8 | data[0];	/* file type and access mode */
+	inode->nlink = data[2];			/* directory entries */
+	inode->uid = data[3];			/* owner */
+	inode->gid = data[4];			/* group of owner */
+	inode->size = (unsigned int) data[5] << 16 |	/* size */
+		data[7] << 8 | data[6];
+	for (i=0; i<8; ++i)		/* device addresses constituting file */
+		inode->addr[i] = data[9+i+i] << 8 | data[8+i+i];
+	inode->atime = (unsigned int) data[25] << 24 |	/* last access time */
+		(unsigned int) data[24] << 16 | data[27] << 8 | data[26];
+	inode->mtime = (unsigned int) data[29] << 24 |	/* last modification time */
+		(unsigned int) data[28] << 16 | data[31] << 8 | data[30];
+}
+
+/*
+ * Convert inode to raw data, 32 bytes.
+ */
+void u6fs_inode_pack (unsigned char *data, u6fs_inode_t *inode)
+{
+	int i;
+
+	data[0] = inode->mode;			/* file type and access mode */
+	data[1] = inode->mode >> 8;
+	data[2] = inode->nlink;			/* directory entries */
+	data[3] = inode->uid;			/* owner */
+	data[4] = inode->gid;			/* group of owner */
+	data[5] = inode->size >> 16;		/* size */
+	data[6] = inode->size;
+	data[7] = inode->size >> 8;
+	for (i=0; i<8; ++i) {		/* device addresses constituting file */
+		data[8+i+i] = inode->addr[i];
+		data[9+i+i] = inode->addr[i] >> 8;
+	}
+	data[24] = inode->atime >> 16;		/* last access time */
+	data[25] = inode->atime >> 24;
+	data[26] = inode->atime;
+	data[27] = inode->atime >> 8;
+	data[28] = inode->mtime >> 16;		/* last modification time */
+	data[29] = inode->mtime >> 24;
+	data[30] = inode->mtime;
+	data[31] = inode->mtime >> 8;
+}
+
 int u6fs_inode_get (u6fs_t *fs, u6fs_inode_t *inode, unsigned short inum)
 {
 	unsigned int offset;
-	unsigned char size2;
-	unsigned short size10;
-	int i;
+	unsigned char data [32], *cached;
 
 	memset (inode, 0, sizeof (*inode));
 	inode->fs = fs;
 	inode->number = inum;
+	fs->io.inodes++;
 
 	/* Inodes are numbered starting from 1.
 	 * 32 bytes per inode, 16 inodes per block.
@@ -34,34 +83,44 @@ int u6fs_inode_get (u6fs_t *fs, u6fs_inode_t *inode, unsigned short inum)
 		return 0;
 	offset = (inode->number + 31) * 32;
 
+	if (fs->snapshot) {
+		cached = u6fs_snapshot_block (fs, offset / 512);
+		if (! cached)
+			return 0;
+		u6fs_inode_unpack (inode, cached + offset % 512);
+		return 1;
+	}
 	if (! u6fs_seek (fs, offset))
 		return 0;
-
-	if (! u6fs_read16 (fs, &inode->mode))	/* file type and access mode */
-		return 0;
-	if (! u6fs_read8 (fs, &inode->nlink))	/* directory entries */
-		return 0;
-	if (! u6fs_read8 (fs, &inode->uid))	/* owner */
-		return 0;
-	if (! u6fs_read8 (fs, &inode->gid))	/* group of owner */
+	if (! u6fs_read (fs, data, 32))
 		return 0;
+	u6fs_inode_unpack (inode, data);
+	return 1;
+}
 
-	/* size */
-	if (! u6fs_read8 (fs, &size2))
-		return 0;
-	if (! u6fs_read16 (fs, &size10))
+/*
+ * Read 'count' blocks of I list, starting from block 'bno' of the list.
+ * Block N of I list contains inodes 16*N+1 ... 16*N+16.
+ */
+int u6fs_inode_list_read (u6fs_t *fs, unsigned int bno, unsigned int count,
+	unsigned char *data)
+{
+	if (bno + count > fs->isize)
 		return 0;
-	inode->size = (unsigned int) size2 << 16 | size10;
+	if (fs->snapshot) {
+		unsigned char *cached;
 
-	for (i=0; i<8; ++i) {		/* device addresses constituting file */
-		if (! u6fs_read16 (fs, &inode->addr[i]))
-			return 0;
+		for (; count > 0; count--, bno++, data += 512) {
+			cached = u6fs_snapshot_block (fs, bno + 2);
+			if (! cached)
+				return 0;
+			memcpy (data, cached, 512);
+		}
+		return 1;
 	}
-	if (! u6fs_read32 (fs, &inode->atime))	/* last access time */
-		return 0;
-	if (! u6fs_read32 (fs, &inode->mtime))	/* last modification time */
+	if (! u6fs_seek (fs, (bno + 2) * 512L))
 		return 0;
-	return 1;
+	return u6fs_read (fs, data, count * 512);
 }
 
 /*
@@ -114,17 +173,12 @@ void u6fs_inode_clear (u6fs_inode_t *inode)
 
 int u6fs_inode_save (u6fs_inode_t *inode, int force)
 {
-	unsigned int offset;
-	int i;
         time_t tt;
 
 	if (! inode->fs->writable)
 		return 0;
 	if (! force && ! inode->dirty)
 		return 1;
-	if (inode->number == 0 || inode->number > inode->fs->isize*16)
-		return 0;
-	offset = (inode->number + 31) * 32;
 
         time (&tt);
         inode->atime = tt;
@@ -132,33 +186,39 @@ int u6fs_inode_save (u6fs_inode_t *inode, int force)
 	// time (&inode->atime);
 	// time (&inode->mtime);
 
-	if (! u6fs_seek (inode->fs, offset))
-		return 0;
+	return u6fs_inode_save_times (inode, force);
+}
 
-	if (! u6fs_write16 (inode->fs, inode->mode))	/* file type and access mode */
-		return 0;
-	if (! u6fs_write8 (inode->fs, inode->nlink))	/* directory entries */
-		return 0;
-	if (! u6fs_write8 (inode->fs, inode->uid))	/* owner */
-		return 0;
-	if (! u6fs_write8 (inode->fs, inode->gid))	/* group of owner */
-		return 0;
+/*
+ * Save inode, keeping access and modification times unchanged.
+ */
+int u6fs_inode_save_times (u6fs_inode_t *inode, int force)
+{
+	unsigned int offset;
+	unsigned char data [32], *cached;
 
-	/* size */
-	if (! u6fs_write8 (inode->fs, inode->size >> 16))
+	if (! inode->fs->writable)
 		return 0;
-	if (! u6fs_write16 (inode->fs, inode->size))
+	if (! force && ! inode->dirty)
+		return 1;
+	if (inode->number == 0 || inode->number > inode->fs->isize*16)
 		return 0;
+	offset = (inode->number + 31) * 32;
 
-	for (i=0; i<8; ++i) {		/* device addresses constituting file */
-		if (! u6fs_write16 (inode->fs, inode->addr[i]))
+	if (inode->fs->snapshot) {
+		cached = u6fs_snapshot_block (inode->fs, offset / 512);
+		if (! cached)
+			return 0;
+		u6fs_inode_pack (cached + offset % 512, inode);
+		if (! u6fs_snapshot_write (inode->fs, offset / 512, 0))
+			return 0;
+	} else {
+		u6fs_inode_pack (data, inode);
+		if (! u6fs_seek (inode->fs, offset))
+			return 0;
+		if (! u6fs_write (inode->fs, data, 32))
 			return 0;
 	}
-	if (! u6fs_write32 (inode->fs, inode->atime))	/* last access time */
-		return 0;
-	if (! u6fs_write32 (inode->fs, inode->mtime))	/* last modification time */
-		return 0;
-
 	inode->dirty = 0;
 	return 1;
 }
@@ -207,29 +267,36 @@ void u6fs_directory_scan (u6fs_inode_t *dir, char *dirname,
 	u6fs_directory_scanner_t scanner, void *arg)
 {
 	u6fs_inode_t file;
-	unsigned int offset;
-	unsigned char data [17];
+	unsigned int offset, n;
+	unsigned char data [512], *p;
+	char name [14+1];
 	unsigned int inum;
 
-	/* 16 bytes per file */
-	for (offset = 0; dir->size - offset >= 16; offset += 16) {
-		if (! u6fs_inode_read (dir, offset, data, 16)) {
+	/* 16 bytes per file, read by whole blocks */
+	for (offset = 0; dir->size - offset >= 16; offset += n) {
+		n = dir->size - offset;
+		if (n > 512)
+			n = 512;
+		n &= ~15;
+		if (! u6fs_inode_read (dir, offset, data, n)) {
 			fprintf (stderr, "%s: read error at offset %ld\n",
 				dirname[0] ? dirname : "/", offset);
 			return;
 		}
-		data [16] = 0;
-		inum = data [1] << 8 | data [0];
-
-		if (inum == 0 || (data[2]=='.' && data[3]==0) ||
-		    (data[2]=='.' && data[3]=='.' && data[4]==0))
-			continue;
-
-		if (! u6fs_inode_get (dir->fs, &file, inum)) {
-			fprintf (stderr, "cannot scan inode %d\n", inum);
-			continue;
+		for (p = data; p < data + n; p += 16) {
+			inum = p [1] << 8 | p [0];
+			if (inum == 0 || (p[2]=='.' && p[3]==0) ||
+			    (p[2]=='.' && p[3]=='.' && p[4]==0))
+				continue;
+
+			if (! u6fs_inode_get (dir->fs, &file, inum)) {
+				fprintf (stderr, "cannot scan inode %d\n", inum);
+				continue;
+			}
+			memcpy (name, p + 2, 14);
+			name [14] = 0;
+			scanner (dir, &file, dirname, name, arg);
 		}
-		scanner (dir, &file, dirname, &data[2], arg);
 	}
 }
 
@@ -281,6 +348,150 @@ static unsigned short map_block (u6fs_inode_t *inode, unsigned short lbn)
 	return nb;
 }
 
+/*
+ * Return the physical block number of the given logical block
+ * of the file, or 0 when the block is not allocated.
+ */
+unsigned short u6fs_inode_map (u6fs_inode_t *inode, unsigned short lbn)
+{
+	return map_block (inode, lbn);
+}
+
+/*
+ * Get physical numbers of the first 'nblocks' blocks of the file.
+ * Unlike u6fs_inode_map(), every indirect block is read only once.
+ * Missing blocks are returned as 0.
+ */
+int u6fs_inode_blocks (u6fs_inode_t *inode, unsigned short *list,
+	unsigned int nblocks)
+{
+	unsigned char block [512], dblock [512];
+	unsigned int i, j, k, nb;
+
+	memset (list, 0, nblocks * sizeof (*list));
+	if (! (inode->mode & INODE_MODE_LARG)) {
+		/* small file algorithm */
+		for (i=0; i<8 && i<nblocks; i++)
+			list[i] = inode->addr[i];
+		return 1;
+	}
+
+	/* large file algorithm */
+	for (i=0; i<7 && i*256 < nblocks; i++) {
+		if (inode->addr[i] == 0)
+			continue;
+		if (! u6fs_read_block (inode->fs, inode->addr[i], block))
+			return 0;
+		for (j=0; j<256 && i*256 + j < nblocks; j++)
+			list [i*256 + j] = block [j+j+1] << 8 | block [j+j];
+	}
+
+	/* "huge" fetch of double indirect block */
+	if (nblocks <= 7*256 || inode->addr[7] == 0)
+		return 1;
+	if (! u6fs_read_block (inode->fs, inode->addr[7], dblock))
+		return 0;
+	for (k=0; k<256 && (7+k)*256 < nblocks; k++) {
+		nb = dblock [k+k+1] << 8 | dblock [k+k];
+		if (nb == 0)
+			continue;
+		if (! u6fs_read_block (inode->fs, nb, block))
+			return 0;
+		for (j=0; j<256 && (7+k)*256 + j < nblocks; j++)
+			list [(7+k)*256 + j] = block [j+j+1] << 8 | block [j+j];
+	}
+	return 1;
+}
+
+/*
+ * Allocate 'nblocks' data blocks for an empty file, together with
+ * all the indirect blocks needed, and write the indirect blocks.
+ * Physical numbers of data blocks are returned in the list.
+ * On failure, all the blocks taken are freed again.
+ */
+int u6fs_inode_alloc_blocks (u6fs_inode_t *inode, unsigned short *list,
+	unsigned int nblocks)
+{
+	unsigned char block [512], dblock [512];
+	unsigned int lbn, i, nb, ib, db;
+
+	memset (inode->addr, 0, sizeof (inode->addr));
+	inode->mode &= ~INODE_MODE_LARG;
+	inode->dirty = 1;
+	ib = db = 0;
+	if (nblocks <= 8) {
+		/* small file algorithm */
+		for (lbn=0; lbn<nblocks; lbn++) {
+			if (! u6fs_block_alloc (inode->fs, &nb))
+				goto failed;
+			inode->addr[lbn] = list[lbn] = nb;
+		}
+		return 1;
+	}
+
+	/* large file algorithm */
+	inode->mode |= INODE_MODE_LARG;
+	for (lbn=0; lbn<nblocks; lbn++) {
+		if (lbn % 256 == 0) {
+			i = lbn >> 8;
+			if (i >= 7 && db == 0) {
+				/* "huge" file - double indirect block */
+				if (! u6fs_block_alloc (inode->fs, &db))
+					goto failed;
+				memset (dblock, 0, 512);
+				inode->addr[7] = db;
+			}
+			/* Start a new indirect block. */
+			if (! u6fs_block_alloc (inode->fs, &ib))
+				goto failed;
+			memset (block, 0, 512);
+			if (i < 7)
+				inode->addr[i] = ib;
+			else {
+				i = (i - 7) * 2;
+				dblock[i] = ib;
+				dblock[i+1] = ib >> 8;
+			}
+		}
+		if (! u6fs_block_alloc (inode->fs, &nb))
+			goto failed;
+		list[lbn] = nb;
+		i = (lbn & 0377) * 2;
+		block[i] = nb;
+		block[i+1] = nb >> 8;
+		if ((lbn + 1) % 256 == 0 || lbn + 1 == nblocks) {
+			if (! u6fs_write_block (inode->fs, ib, block)) {
+				lbn++;		/* this block is taken too */
+				goto failed;
+			}
+		}
+	}
+	if (db && ! u6fs_write_block (inode->fs, db, dblock))
+		goto failed;
+	return 1;
+
+failed:
+	/* Return the blocks taken so far to the free list. */
+	for (i=0; i<lbn; i++)
+		u6fs_block_free (inode->fs, list[i]);
+	if (inode->mode & INODE_MODE_LARG) {
+		for (i=0; i<7; i++)
+			if (inode->addr[i])
+				u6fs_block_free (inode->fs, inode->addr[i]);
+		if (db) {
+			for (i=0; i<512; i+=2) {
+				nb = dblock[i+1] << 8 | dblock[i];
+				if (nb)
+					u6fs_block_free (inode->fs, nb);
+			}
+			u6fs_block_free (inode->fs, db);
+		}
+	}
+	memset (inode->addr, 0, sizeof (inode->addr));
+	inode->mode &= ~INODE_MODE_LARG;
+	return 0;
+}
+
 /*
  * Bmap defines the structure of file system storage
  * by returning the physical block number on a device given the
@@ -352,14 +563,14 @@ large:
 			if (! u6fs_read_block (inode->fs, nb, block))
 				return 0;
 		} else {
-			/* allocate new block */
+			/* allocate new block, link it to double indirect */
 			if (! u6fs_block_alloc (inode->fs, &nb))
 				return 0;
-			memset (block, 0, 512);
-			block[i+i] = nb;
-			block[i+i+1] = nb >> 8;
+			block[i] = nb;
+			block[i+1] = nb >> 8;
 			if (! u6fs_write_block (inode->fs, ib, block))
 				return 0;
+			memset (block, 0, 512);
 		}
 		ib = nb;
 	}
@@ -404,6 +615,7 @@ int u6fs_inode_read (u6fs_inode_t *inode, unsigned int offset,
 			return 0;
 		memcpy (data, block + inblock_offset, n);
 		offset += n;
+		data += n;
 		bytes -= n;
 	}
 	return 1;
@@ -445,6 +657,7 @@ int u6fs_inode_write (u6fs_inode_t *inode, unsigned int offset,
 				return 0;
 		}
 		offset += n;
+		data += n;
 		bytes -= n;
 	}
 	return 1;
@@ -597,6 +810,15 @@ write_back:
 	if (! u6fs_inode_write (&dir, offset, data, 16)) {
 		fprintf (stderr, "inode %d: write error at offset %ld\n",
 			inode->number, offset);
+		if (op == 1) {
+			/* No room for the entry: free the new inode. */
+			u6fs_inode_clear (inode);
+			u6fs_inode_save (inode, 0);
+			if (fs->ninode < 100) {
+				fs->inode [fs->ninode++] = inode->number;
+				fs->dirty = 1;
+			}
+		}
 		return 0;
 	}
 	if (! u6fs_inode_save (&dir, 0)) {
@@ -648,6 +870,79 @@ create_link:
 	return 1;
 }
 
+/*
+ * Create all missing parent directories of the name.
+ */
+void u6fs_directory_parents (u6fs_t *fs, char *name)
+{
+	u6fs_inode_t inode;
+	char *p;
+
+	for (p = strchr (name, '/'); p; p = strchr (p+1, '/')) {
+		if (p == name)
+			continue;
+		*p = 0;
+		if (! u6fs_inode_by_name (fs, &inode, name, 0, 0))
+			u6fs_directory_create (fs, name, 0777);
+		*p = '/';
+	}
+}
+
+/*
+ * Create a directory with links '.' and '..'.
+ */
+int u6fs_directory_create (u6fs_t *fs, char *name, int mode)
+{
+	u6fs_inode_t dir, parent;
+	char buf [512], *p;
+
+	/* Open parent directory. */
+	strcpy (buf, name);
+	p = strrchr (buf, '/');
+	if (p)
+		*p = 0;
+	else
+		*buf = 0;
+	if (! u6fs_inode_by_name (fs, &parent, buf, 0, 0)) {
+		fprintf (stderr, "%s: cannot open directory\n", buf);
+		return 0;
+	}
+
+	/* Create directory. */
+	if (! u6fs_inode_by_name (fs, &dir, name, 1,
+	    INODE_MODE_FDIR | (mode & 07777))) {
+		fprintf (stderr, "%s: directory inode create failed\n", name);
+		return 0;
+	}
+	u6fs_inode_save (&dir, 0);
+
+	/* Make link '.' */
+	strcpy (buf, name);
+	strcat (buf, "/.");
+	if (! u6fs_inode_by_name (fs, &dir, buf, 3, dir.number)) {
+		fprintf (stderr, "%s: dot link failed\n", name);
+		return 0;
+	}
+	++dir.nlink;
+	u6fs_inode_save (&dir, 1);
+/*printf ("*** inode %d: increment link counter to %d\n", dir.number, dir.nlink);*/
+
+	/* Make parent link '..' */
+	strcat (buf, ".");
+	if (! u6fs_inode_by_name (fs, &dir, buf, 3, parent.number)) {
+		fprintf (stderr, "%s: dotdot link failed\n", name);
+		return 0;
+	}
+	if (! u6fs_inode_get (fs, &parent, parent.number)) {
+		fprintf (stderr, "inode %d: cannot open parent\n", parent.number);
+		return 0;
+	}
+	++parent.nlink;
+	u6fs_inode_save (&parent, 1);
+/*printf ("*** inode %d: increment link counter to %d\n", parent.number, parent.nlink);*/
+	return 1;
+}
+
 /*
  * Allocate an unused I node
  * on the specified device.
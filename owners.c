@@ -0,0 +1,250 @@
+/*
+ * Index of block owners for unix v6 filesystem.
+ *
+ * Copyright (C) 2006 Serge Vakulenko, <vak@cronyx.ru>
+ *
+ * This file is part of BKUNIX project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "u6fs.h"
+
+extern int verbose;
+
+#define ILIST_CHUNK	32		/* I list blocks read at once */
+#define OWNERS_MAGIC	"u6fsown2"
+
+#define inrange(fs,x)	((x) >= (fs)->isize + 2 && (x) < (fs)->fsize)
+
+/*
+ * Header of the sidecar file. Records of 6 bytes follow,
+ * one per block: inode, logical block, role and claims.
+ * The file is valid only while the image is not changed.
+ */
+typedef struct {
+	char		magic [8];
+	unsigned short	fsize, isize;		/* geometry of the image */
+	unsigned int	fstime;			/* superblock update time */
+	long long	size, mtime;		/* image file status */
+	long		mtime_nsec;
+} owners_header_t;
+
+/*
+ * Record the owner of the block. The first owner is kept,
+ * later ones are only counted.
+ */
+static void claim (u6fs_owners_t *ow, unsigned short bno,
+	unsigned short inum, unsigned short lbn, int role)
+{
+	u6fs_owner_t *o = &ow->owner [bno];
+
+	if (o->claims == 0) {
+		o->inum = inum;
+		o->lbn = lbn;
+		o->role = role;
+	} else if (o->claims == 1)
+		ow->ndups++;
+	if (o->claims < 255)
+		o->claims++;
+}
+
+/*
+ * Claim an indirect block, and all the blocks it maps.
+ */
+static void claim_indirect (u6fs_owners_t *ow, u6fs_t *fs,
+	unsigned short inum, unsigned short bno, unsigned int lbn, int role)
+{
+	unsigned char data [LSXFS_BSIZE];
+	unsigned short nb;
+	int i;
+
+	if (! inrange (fs, bno))
+		return;
+	claim (ow, bno, inum, lbn, role);
+	if (! u6fs_read_block (fs, bno, data)) {
+		fprintf (stderr, "owners: read error at block %d\n", bno);
+		return;
+	}
+	for (i = 0; i < 256; i++) {
+		nb = data [i*2+1] << 8 | data [i*2];
+		if (! inrange (fs, nb))
+			continue;
+		if (role == U6FS_ROLE_DIND)
+			claim_indirect (ow, fs, inum, nb, lbn + i * 256,
+				U6FS_ROLE_IND);
+		else
+			claim (ow, nb, inum, lbn + i, U6FS_ROLE_DATA);
+	}
+}
+
+/*
+ * Find owners of all blocks in one sequential sweep
+ * of the I list. Indirect blocks are read through the
+ * snapshot, when it is loaded.
+ */
+int u6fs_owners_build (u6fs_owners_t *ow, u6fs_t *fs)
+{
+	u6fs_inode_t inode;
+	unsigned char ilist [ILIST_CHUNK * LSXFS_BSIZE];
+	unsigned int bno, nblocks, i, k;
+	unsigned short inum;
+	int fmt;
+
+	memset (ow, 0, sizeof (*ow));
+	ow->nblocks = fs->fsize;
+	ow->owner = calloc (fs->fsize, sizeof (*ow->owner));
+	if (! ow->owner)
+		return 0;
+
+	for (bno = 0; bno < fs->isize; bno += nblocks) {
+		nblocks = fs->isize - bno;
+		if (nblocks > ILIST_CHUNK)
+			nblocks = ILIST_CHUNK;
+		if (! u6fs_inode_list_read (fs, bno, nblocks, ilist)) {
+			fprintf (stderr, "owners: read error at block %d\n",
+				bno + 2);
+			continue;
+		}
+		for (i = 0; i < nblocks * LSXFS_INODES_PER_BLOCK; i++) {
+			inum = bno * LSXFS_INODES_PER_BLOCK + i + 1;
+			memset (&inode, 0, sizeof (inode));
+			inode.fs = fs;
+			inode.number = inum;
+			u6fs_inode_unpack (&inode, ilist + i * 32);
+			fmt = inode.mode & INODE_MODE_FMT;
+			if (! (inode.mode & INODE_MODE_ALLOC) ||
+			    fmt == INODE_MODE_FCHR || fmt == INODE_MODE_FBLK)
+				continue;
+			if (! (inode.mode & INODE_MODE_LARG)) {
+				/* Small file - up to 8 direct blocks. */
+				for (k = 0; k < 8; k++)
+					if (inrange (fs, inode.addr [k]))
+						claim (ow, inode.addr [k], inum,
+							k, U6FS_ROLE_DATA);
+				continue;
+			}
+			/* Large file - 7 indirect blocks and
+			 * one double indirect block. */
+			for (k = 0; k < 7; k++)
+				claim_indirect (ow, fs, inum, inode.addr [k],
+					k * 256, U6FS_ROLE_IND);
+			claim_indirect (ow, fs, inum, inode.addr [7],
+				7 * 256, U6FS_ROLE_DIND);
+		}
+	}
+	if (verbose)
+		fprintf (stderr, "owners: %u blocks, %u claimed twice\n",
+			ow->nblocks, ow->ndups);
+	return 1;
+}
+
+static int owners_ident (u6fs_t *fs, owners_header_t *h)
+{
+	struct stat st;
+
+	memset (h, 0, sizeof (*h));
+	if (fstat (fs->fd, &st) < 0)
+		return 0;
+	memcpy (h->magic, OWNERS_MAGIC, 8);
+	h->fsize = fs->fsize;
+	h->isize = fs->isize;
+	h->fstime = fs->time;
+	h->size = st.st_size;
+	h->mtime = st.st_mtime;
+	h->mtime_nsec = U6FS_MTIME_NSEC (st);
+	return 1;
+}
+
+/*
+ * Save the index to the file.
+ */
+int u6fs_owners_save (u6fs_owners_t *ow, u6fs_t *fs, const char *name)
+{
+	owners_header_t h;
+	unsigned char rec [6];
+	unsigned int bno;
+	FILE *f;
+	int ok;
+
+	if (! owners_ident (fs, &h))
+		return 0;
+	f = fopen (name, "w");
+	if (! f) {
+		perror (name);
+		return 0;
+	}
+	ok = fwrite (&h, sizeof (h), 1, f) == 1;
+	for (bno = 0; ok && bno < ow->nblocks; bno++) {
+		rec [0] = ow->owner [bno].inum;
+		rec [1] = ow->owner [bno].inum >> 8;
+		rec [2] = ow->owner [bno].lbn;
+		rec [3] = ow->owner [bno].lbn >> 8;
+		rec [4] = ow->owner [bno].role;
+		rec [5] = ow->owner [bno].claims;
+		ok = fwrite (rec, sizeof (rec), 1, f) == 1;
+	}
+	if (fclose (f) != 0)
+		ok = 0;
+	if (! ok) {
+		fprintf (stderr, "%s: write error\n", name);
+		remove (name);
+	}
+	return ok;
+}
+
+/*
+ * Load the index, saved for the same state of the image.
+ * Return 0 when the file is missing or stale.
+ */
+int u6fs_owners_load (u6fs_owners_t *ow, u6fs_t *fs, const char *name)
+{
+	owners_header_t h, cur;
+	unsigned char rec [6];
+	unsigned int bno;
+	FILE *f;
+
+	memset (ow, 0, sizeof (*ow));
+	if (! owners_ident (fs, &cur))
+		return 0;
+	f = fopen (name, "r");
+	if (! f)
+		return 0;
+	if (fread (&h, sizeof (h), 1, f) != 1 ||
+	    memcmp (&h, &cur, sizeof (h)) != 0) {
+		fclose (f);
+		return 0;
+	}
+	ow->nblocks = fs->fsize;
+	ow->owner = calloc (fs->fsize, sizeof (*ow->owner));
+	if (! ow->owner) {
+		fclose (f);
+		return 0;
+	}
+	for (bno = 0; bno < ow->nblocks; bno++) {
+		if (fread (rec, sizeof (rec), 1, f) != 1) {
+			fclose (f);
+			u6fs_owners_free (ow);
+			return 0;
+		}
+		ow->owner [bno].inum = rec [1] << 8 | rec [0];
+		ow->owner [bno].lbn = rec [3] << 8 | rec [2];
+		ow->owner [bno].role = rec [4];
+		ow->owner [bno].claims = rec [5];
+		if (rec [5] > 1)
+			ow->ndups++;
+	}
+	fclose (f);
+	return 1;
+}
+
+void u6fs_owners_free (u6fs_owners_t *ow)
+{
+	if (ow->owner)
+		free (ow->owner);
+	ow->owner = 0;
+	ow->nblocks = 0;
+}
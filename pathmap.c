@@ -0,0 +1,202 @@
+/*
+ * Map of inode numbers to path names for unix v6 filesystem.
+ *
+ * Copyright (C) 2006 Serge Vakulenko, <vak@cronyx.ru>
+ *
+ * This file is part of BKUNIX project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "u6fs.h"
+
+extern int verbose;
+
+#define ILIST_CHUNK	32	/* I list blocks read at once */
+#define MAX_DEPTH	256	/* longest chain of parents */
+
+/*
+ * Add a name of the inode, after all names found before.
+ */
+static int add_link (u6fs_pathmap_t *pm, unsigned int *last,
+	unsigned short inum, unsigned short parent, unsigned char *name)
+{
+	u6fs_link_t *link;
+	unsigned int n;
+
+	if (pm->nlinks >= pm->maxlinks) {
+		n = pm->maxlinks ? pm->maxlinks * 2 : 256;
+		link = realloc (pm->link, n * sizeof (*link));
+		if (! link)
+			return 0;
+		pm->link = link;
+		pm->maxlinks = n;
+	}
+	link = &pm->link [pm->nlinks];
+	link->parent = parent;
+	memcpy (link->name, name, 14);
+	link->name [14] = 0;
+	link->next = 0;
+	if (last [inum])
+		pm->link [last [inum]].next = pm->nlinks;
+	else
+		pm->first [inum] = pm->nlinks;
+	last [inum] = pm->nlinks++;
+	return 1;
+}
+
+/*
+ * Find all names of all inodes in one pass.
+ * The I list is read sequentially to learn which inodes
+ * are directories, then the tree is walked breadth first,
+ * reading directories by whole blocks. Every directory
+ * is entered once, so loops of links are harmless.
+ */
+int u6fs_pathmap_build (u6fs_pathmap_t *pm, u6fs_t *fs)
+{
+	u6fs_inode_t dir;
+	unsigned char ilist [ILIST_CHUNK * LSXFS_BSIZE];
+	unsigned char data [LSXFS_BSIZE], *p;
+	unsigned short *queue, inum, mode;
+	unsigned int *last, head, tail, bno, nblocks, offset, n, i;
+	char *isdir;
+	int ok = 0;
+
+	memset (pm, 0, sizeof (*pm));
+	pm->fs = fs;
+	pm->ninodes = fs->isize * LSXFS_INODES_PER_BLOCK;
+	pm->first = calloc (pm->ninodes + 1, sizeof (*pm->first));
+	last = calloc (pm->ninodes + 1, sizeof (*last));
+	queue = calloc (pm->ninodes + 1, sizeof (*queue));
+	isdir = calloc (pm->ninodes + 1, 1);
+	if (! pm->first || ! last || ! queue || ! isdir)
+		goto done;
+	pm->nlinks = 1;				/* link 0 means none */
+
+	for (bno = 0; bno < fs->isize; bno += nblocks) {
+		nblocks = fs->isize - bno;
+		if (nblocks > ILIST_CHUNK)
+			nblocks = ILIST_CHUNK;
+		if (! u6fs_inode_list_read (fs, bno, nblocks, ilist)) {
+			fprintf (stderr, "pathmap: read error at block %d\n",
+				bno + 2);
+			continue;
+		}
+		for (i = 0; i < nblocks * LSXFS_INODES_PER_BLOCK; i++) {
+			mode = ilist [i*32] | ilist [i*32 + 1] << 8;
+			if ((mode & INODE_MODE_ALLOC) &&
+			    (mode & INODE_MODE_FMT) == INODE_MODE_FDIR)
+				isdir [bno * LSXFS_INODES_PER_BLOCK + i + 1] = 1;
+		}
+	}
+
+	head = tail = 0;
+	queue [tail++] = LSXFS_ROOT_INODE;
+	isdir [LSXFS_ROOT_INODE] = 2;		/* entered */
+	while (head < tail) {
+		inum = queue [head++];
+		if (! u6fs_inode_get (fs, &dir, inum))
+			continue;
+		for (offset = 0; dir.size - offset >= 16; offset += n) {
+			n = dir.size - offset;
+			if (n > LSXFS_BSIZE)
+				n = LSXFS_BSIZE;
+			n &= ~15;
+			if (! u6fs_inode_read (&dir, offset, data, n))
+				break;
+			for (p = data; p < data + n; p += 16) {
+				i = p[1] << 8 | p[0];
+				if (i == 0 || i > pm->ninodes ||
+				    (p[2]=='.' && p[3]==0) ||
+				    (p[2]=='.' && p[3]=='.' && p[4]==0))
+					continue;
+				if (! add_link (pm, last, i, inum, p + 2))
+					goto done;
+				if (isdir [i] == 1) {
+					isdir [i] = 2;
+					queue [tail++] = i;
+				}
+			}
+		}
+	}
+	ok = 1;
+done:
+	free (last);
+	free (queue);
+	free (isdir);
+	if (! ok)
+		u6fs_pathmap_free (pm);
+	return ok;
+}
+
+/*
+ * Return the first name of the inode, when prev is 0,
+ * or the name after prev. Return 0 when no more names.
+ */
+unsigned int u6fs_pathmap_link (u6fs_pathmap_t *pm, unsigned short inum,
+	unsigned int prev)
+{
+	if (prev)
+		return pm->link [prev].next;
+	if (! pm->first || inum == 0 || inum > pm->ninodes)
+		return 0;
+	return pm->first [inum];
+}
+
+/*
+ * Make the full path of the name, up to the root.
+ * Directories are named by their first name.
+ * Return 0 when the path is too long or broken.
+ */
+char *u6fs_pathmap_path (u6fs_pathmap_t *pm, unsigned int link,
+	char *buf, unsigned int size)
+{
+	char *p;
+	unsigned int len, depth;
+
+	if (size < 2)
+		return 0;
+	p = buf + size - 1;
+	*p = 0;
+	for (depth = 0; link; depth++) {
+		len = strlen (pm->link [link].name);
+		if (depth >= MAX_DEPTH || p - buf < len + 1)
+			return 0;
+		p -= len;
+		memcpy (p, pm->link [link].name, len);
+		*--p = '/';
+		if (pm->link [link].parent == LSXFS_ROOT_INODE) {
+			memmove (buf, p, buf + size - p);
+			return buf;
+		}
+		link = pm->first [pm->link [link].parent];
+	}
+	return 0;
+}
+
+/*
+ * Make the first path of the inode.
+ */
+char *u6fs_pathmap_name (u6fs_pathmap_t *pm, unsigned short inum,
+	char *buf, unsigned int size)
+{
+	if (inum == LSXFS_ROOT_INODE && size >= 2) {
+		strcpy (buf, "/");
+		return buf;
+	}
+	return u6fs_pathmap_path (pm, u6fs_pathmap_link (pm, inum, 0),
+		buf, size);
+}
+
+void u6fs_pathmap_free (u6fs_pathmap_t *pm)
+{
+	if (pm->first)
+		free (pm->first);
+	if (pm->link)
+		free (pm->link);
+	pm->first = 0;
+	pm->link = 0;
+	pm->nlinks = pm->maxlinks = 0;
+}
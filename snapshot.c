@@ -0,0 +1,627 @@
+/*
+ * In-memory snapshot of filesystem metadata for unix v6 filesystem.
+ *
+ * Copyright (C) 2006 Serge Vakulenko, <vak@cronyx.ru>
+ *
+ * This file is part of BKUNIX project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "u6fs.h"
+
+extern int verbose;
+
+#define SNAP_RUN	64	/* max blocks read or written at once */
+
+#define KIND_DATA	1	/* directory data block */
+#define KIND_IND	2	/* indirect block */
+#define KIND_DIND	4	/* double indirect block */
+#define KIND_DIR	8	/* block belongs to a directory */
+#define KIND_SEEN	16	/* indirect block already scanned */
+
+#define INDEX_MAGIC	"u6fs-idx"
+
+#define inrange(fs,x)	((x) >= (fs)->isize + 2 && (x) < (fs)->fsize)
+
+/*
+ * Header of the index file. Metadata blocks follow,
+ * each with 4 bytes of block number and kind.
+ */
+typedef struct {
+	char		magic [8];
+	unsigned short	fsize, isize;		/* geometry of the image */
+	unsigned int	fstime;			/* superblock update time */
+	unsigned long long digest;		/* of superblock and I list */
+	unsigned int	nblocks;		/* number of blocks saved */
+	unsigned int	reserved;
+} index_header_t;
+
+/*
+ * Read a run of blocks from the device.
+ */
+static int read_run (u6fs_t *fs, unsigned short bno, unsigned int count,
+	unsigned char *data)
+{
+	if (! u6fs_seek (fs, bno * 512L) ||
+	    ! u6fs_read (fs, data, count * LSXFS_BSIZE)) {
+		fprintf (stderr, "snapshot: read error at block %d\n", bno);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Ask the kernel to start reading all wanted blocks in background,
+ * so that the reads of a level overlap, instead of waiting
+ * for every run in turn. Sector remapped images are small,
+ * they are prefetched as a whole.
+ */
+static void prefetch_wanted (u6fs_t *fs, char *wanted)
+{
+#ifdef POSIX_FADV_WILLNEED
+	unsigned int bno, n;
+
+	if (! fs->flat) {
+		posix_fadvise (fs->fd, 0, 0, POSIX_FADV_WILLNEED);
+		return;
+	}
+	for (bno = 0; bno < fs->fsize; bno += n) {
+		n = 1;
+		if (! wanted [bno])
+			continue;
+		while (bno + n < fs->fsize && wanted [bno + n])
+			n++;
+		posix_fadvise (fs->fd, bno * 512L, n * 512L,
+			POSIX_FADV_WILLNEED);
+	}
+#endif
+}
+
+/*
+ * Load all wanted blocks in ascending order, by runs of
+ * adjacent blocks. Clear the wanted map.
+ */
+static int load_wanted (u6fs_t *fs, char *wanted)
+{
+	u6fs_snapshot_t *s = fs->snapshot;
+	unsigned char data [SNAP_RUN * LSXFS_BSIZE];
+	unsigned int bno, n, i;
+
+	prefetch_wanted (fs, wanted);
+	for (bno = 0; bno < fs->fsize; bno += n) {
+		if (! wanted [bno]) {
+			n = 1;
+			continue;
+		}
+		for (n = 1; n < SNAP_RUN && bno + n < fs->fsize; n++)
+			if (! wanted [bno + n])
+				break;
+		if (! read_run (fs, bno, n, data))
+			return 0;
+		for (i = 0; i < n; i++) {
+			s->block [bno + i] = malloc (LSXFS_BSIZE);
+			if (! s->block [bno + i])
+				return 0;
+			memcpy (s->block [bno + i], data + i * LSXFS_BSIZE,
+				LSXFS_BSIZE);
+			wanted [bno + i] = 0;
+			s->nloaded++;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Mark the block as needed on the next level.
+ * Return 1 when the block is not loaded yet.
+ */
+static int want (u6fs_t *fs, char *wanted, unsigned short bno, int kind)
+{
+	if (! inrange (fs, bno))
+		return 0;
+	fs->snapshot->kind [bno] |= kind;
+	if (fs->snapshot->block [bno])
+		return 0;
+	wanted [bno] = 1;
+	return 1;
+}
+
+/*
+ * Create an empty snapshot, and read the I list into it.
+ */
+static int load_ilist (u6fs_t *fs, char *wanted)
+{
+	u6fs_snapshot_t *s;
+	unsigned int bno;
+
+	s = calloc (1, sizeof (*s));
+	if (! s)
+		return 0;
+	fs->snapshot = s;
+	s->block = calloc (fs->fsize, sizeof (*s->block));
+	s->dirty = calloc (fs->fsize, sizeof (*s->dirty));
+	s->kind = calloc (fs->fsize, sizeof (*s->kind));
+	if (! s->block || ! s->dirty || ! s->kind)
+		return 0;
+	for (bno = 2; bno < fs->isize + 2 && bno < fs->fsize; bno++)
+		wanted [bno] = 1;
+	return load_wanted (fs, wanted);
+}
+
+/*
+ * Read the I list, then all directory blocks and indirect blocks,
+ * level by level. Every level is read by a single ascending sweep.
+ */
+int u6fs_snapshot_load (u6fs_t *fs)
+{
+	u6fs_snapshot_t *s;
+	u6fs_inode_t inode;
+	unsigned char *data;
+	unsigned int inum, bno, i, kind, more;
+	unsigned short nb;
+	char *wanted;
+
+	if (fs->snapshot)
+		return 1;
+	wanted = calloc (fs->fsize, sizeof (*wanted));
+	if (! wanted || ! load_ilist (fs, wanted))
+		goto failed;
+	s = fs->snapshot;
+
+	/* Level 1: blocks addressed by inodes. */
+	for (inum = 1; inum <= fs->isize * LSXFS_INODES_PER_BLOCK; inum++) {
+		data = s->block [(inum + 31) / 16] + (inum + 31) % 16 * 32;
+		memset (&inode, 0, sizeof (inode));
+		u6fs_inode_unpack (&inode, data);
+		if (! (inode.mode & INODE_MODE_ALLOC) ||
+		    (inode.mode & INODE_MODE_FMT) == INODE_MODE_FCHR ||
+		    (inode.mode & INODE_MODE_FMT) == INODE_MODE_FBLK)
+			continue;
+		kind = ((inode.mode & INODE_MODE_FMT) == INODE_MODE_FDIR) ?
+			KIND_DIR : 0;
+		if (! (inode.mode & INODE_MODE_LARG)) {
+			if (kind)
+				for (i = 0; i < 8; i++)
+					want (fs, wanted, inode.addr[i],
+						KIND_DATA | kind);
+			continue;
+		}
+		for (i = 0; i < 7; i++)
+			want (fs, wanted, inode.addr[i], KIND_IND | kind);
+		want (fs, wanted, inode.addr[7], KIND_DIND | kind);
+	}
+
+	/* Next levels: blocks addressed by indirect blocks. */
+	do {
+		if (! load_wanted (fs, wanted))
+			goto failed;
+		more = 0;
+		for (bno = fs->isize + 2; bno < fs->fsize; bno++) {
+			kind = s->kind [bno];
+			if (! s->block [bno] || (kind & KIND_SEEN) ||
+			    ! (kind & (KIND_IND | KIND_DIND)))
+				continue;
+			s->kind [bno] |= KIND_SEEN;
+			if (! (kind & (KIND_DIND | KIND_DIR)))
+				continue;	/* file data are not needed */
+			for (i = 0; i < LSXFS_BSIZE; i += 2) {
+				nb = s->block [bno][i+1] << 8 | s->block [bno][i];
+				if (kind & KIND_DIND)
+					more += want (fs, wanted, nb, KIND_IND |
+						(kind & KIND_DIR));
+				else
+					more += want (fs, wanted, nb,
+						KIND_DATA | KIND_DIR);
+			}
+		}
+	} while (more);
+
+	if (verbose)
+		fprintf (stderr, "snapshot: %u metadata blocks loaded\n",
+			s->nloaded);
+	free (wanted);
+	return 1;
+failed:
+	if (wanted)
+		free (wanted);
+	u6fs_snapshot_free (fs);
+	return 0;
+}
+
+/*
+ * Return a pointer to the cached block.
+ * Blocks not in the snapshot are read on first access.
+ */
+unsigned char *u6fs_snapshot_block (u6fs_t *fs, unsigned short bno)
+{
+	u6fs_snapshot_t *s = fs->snapshot;
+
+	if (bno >= fs->fsize)
+		return 0;
+	if (! s->block [bno]) {
+		s->block [bno] = malloc (LSXFS_BSIZE);
+		if (! s->block [bno])
+			return 0;
+		if (! read_run (fs, bno, 1, s->block [bno])) {
+			free (s->block [bno]);
+			s->block [bno] = 0;
+			return 0;
+		}
+		s->nloaded++;
+	}
+	return s->block [bno];
+}
+
+static unsigned short block_entry (u6fs_t *fs, unsigned short bno,
+	unsigned int i)
+{
+	unsigned char *data;
+
+	if (! inrange (fs, bno))
+		return 0;
+	data = fs->snapshot->block [bno];
+	if (! data)
+		return 0;
+	return data [i*2+1] << 8 | data [i*2];
+}
+
+/*
+ * Map the logical block of the file to the block number.
+ * Only indirect blocks present in the snapshot are used,
+ * and nothing is read, so many threads can do it at once.
+ * Return 0 for a hole or a missing block.
+ */
+unsigned short u6fs_snapshot_map (u6fs_t *fs, u6fs_inode_t *inode,
+	unsigned int lbn)
+{
+	unsigned short ind;
+
+	if (! (inode->mode & INODE_MODE_LARG))
+		return lbn < 8 ? inode->addr [lbn] : 0;
+	if (lbn < 7 * 256)
+		return block_entry (fs, inode->addr [lbn / 256], lbn % 256);
+	lbn -= 7 * 256;
+	ind = block_entry (fs, inode->addr [7], lbn / 256);
+	return block_entry (fs, ind, lbn % 256);
+}
+
+/*
+ * Replace contents of the block. The device is not
+ * updated until u6fs_snapshot_commit() is called.
+ * When data is 0, the cached block was modified in place.
+ */
+int u6fs_snapshot_write (u6fs_t *fs, unsigned short bno, unsigned char *data)
+{
+	u6fs_snapshot_t *s = fs->snapshot;
+
+	if (bno >= fs->fsize)
+		return 0;
+	if (! s->block [bno]) {
+		s->block [bno] = malloc (LSXFS_BSIZE);
+		if (! s->block [bno])
+			return 0;
+	}
+	if (data)
+		memcpy (s->block [bno], data, LSXFS_BSIZE);
+	if (! s->dirty [bno]) {
+		s->dirty [bno] = 1;
+		s->ndirty++;
+	}
+	return 1;
+}
+
+/*
+ * Write all modified blocks to the device, in ascending order,
+ * by runs of adjacent blocks, and flush them to the disk at once.
+ */
+int u6fs_snapshot_commit (u6fs_t *fs)
+{
+	u6fs_snapshot_t *s = fs->snapshot;
+	unsigned char data [SNAP_RUN * LSXFS_BSIZE];
+	unsigned int bno, n, i;
+
+	if (! s || s->ndirty == 0)
+		return 1;
+	if (verbose)
+		fprintf (stderr, "snapshot: %u blocks modified\n", s->ndirty);
+	for (bno = 0; bno < fs->fsize; bno += n) {
+		if (! s->dirty [bno]) {
+			n = 1;
+			continue;
+		}
+		for (n = 1; n < SNAP_RUN && bno + n < fs->fsize; n++)
+			if (! s->dirty [bno + n])
+				break;
+		for (i = 0; i < n; i++) {
+			memcpy (data + i * LSXFS_BSIZE, s->block [bno + i],
+				LSXFS_BSIZE);
+			s->dirty [bno + i] = 0;
+		}
+		if (! u6fs_seek (fs, bno * 512L) ||
+		    ! u6fs_write (fs, data, n * LSXFS_BSIZE)) {
+			fprintf (stderr, "snapshot: write error at block %d\n",
+				bno);
+			return 0;
+		}
+	}
+	s->ndirty = 0;
+	if (fsync (fs->fd) < 0) {
+		fprintf (stderr, "snapshot: cannot flush %s\n", fs->filename);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Print the modified blocks, which differ from the device,
+ * as a hex dump of changed 16-byte lines. Nothing is written.
+ * Return the number of changed blocks.
+ */
+unsigned int u6fs_snapshot_diff (u6fs_t *fs, FILE *out)
+{
+	u6fs_snapshot_t *s = fs->snapshot;
+	unsigned char old [LSXFS_BSIZE], *new;
+	unsigned int bno, i, k, nchanged = 0;
+	char *what;
+
+	if (! s || s->ndirty == 0)
+		return 0;
+	for (bno = 0; bno < fs->fsize; bno++) {
+		if (! s->dirty [bno])
+			continue;
+		new = s->block [bno];
+		if (! read_run (fs, bno, 1, old) ||
+		    memcmp (old, new, LSXFS_BSIZE) == 0)
+			continue;
+		nchanged++;
+		if (bno == 1)
+			what = "superblock";
+		else if (bno < fs->isize + 2)
+			what = "inode list";
+		else if (s->kind [bno] & (KIND_IND | KIND_DIND))
+			what = "indirect";
+		else if (s->kind [bno] & KIND_DIR)
+			what = "directory";
+		else
+			what = "data";
+		fprintf (out, "@@ block %u, %s\n", bno, what);
+		for (i = 0; i < LSXFS_BSIZE; i += 16) {
+			if (memcmp (old + i, new + i, 16) == 0)
+				continue;
+			fprintf (out, "-%03x:", i);
+			for (k = 0; k < 16; k++)
+				fprintf (out, " %02x", old [i+k]);
+			fprintf (out, "\n+%03x:", i);
+			for (k = 0; k < 16; k++)
+				fprintf (out, " %02x", new [i+k]);
+			fprintf (out, "\n");
+		}
+	}
+	return nchanged;
+}
+
+#define PRIME1	11400714785074694791ULL
+#define PRIME2	14029467366897019727ULL
+#define PRIME3	1609587929392839161ULL
+
+#define rotl(x,n)	((x) << (n) | (x) >> (64 - (n)))
+
+/*
+ * Add a block to the digest. Four independent lanes of 64-bit
+ * words, so the compiler can process them in parallel.
+ */
+static void digest_block (unsigned long long *h, unsigned short bno,
+	unsigned char *data)
+{
+	unsigned long long w [4];
+	int i, k;
+
+	h[0] = rotl (h[0] + bno * PRIME2, 31) * PRIME1;
+	for (i = 0; i < LSXFS_BSIZE; i += sizeof (w)) {
+		memcpy (w, data + i, sizeof (w));
+		for (k = 0; k < 4; k++)
+			h[k] = rotl (h[k] + w[k] * PRIME2, 31) * PRIME1;
+	}
+}
+
+static unsigned long long digest_final (unsigned long long *h)
+{
+	unsigned long long d;
+
+	d = rotl (h[0], 1) + rotl (h[1], 7) + rotl (h[2], 12) + rotl (h[3], 18);
+	d ^= d >> 33;
+	d *= PRIME2;
+	d ^= d >> 29;
+	d *= PRIME3;
+	d ^= d >> 32;
+	return d;
+}
+
+/*
+ * Compute a digest of the superblock, the free list chain
+ * and all the blocks of the snapshot.
+ */
+int u6fs_snapshot_digest (u6fs_t *fs, unsigned long long *digest)
+{
+	u6fs_snapshot_t *s = fs->snapshot;
+	unsigned long long h [4] = { PRIME1 + PRIME2, PRIME2, 0, -PRIME1 };
+	unsigned char *data;
+	unsigned int bno, n;
+
+	if (! s || ! u6fs_snapshot_block (fs, 1))
+		return 0;
+
+	/* Free list chain, linked by the first address. */
+	bno = fs->free [0];
+	for (n = 0; inrange (fs, bno) && n < fs->fsize; n++) {
+		data = u6fs_snapshot_block (fs, bno);
+		if (! data)
+			return 0;
+		bno = data [3] << 8 | data [2];
+	}
+
+	for (bno = 1; bno < fs->fsize; bno++)
+		if (s->block [bno])
+			digest_block (h, bno, s->block [bno]);
+
+	*digest = digest_final (h);
+	return 1;
+}
+
+/*
+ * Digest of the superblock and the I list only.
+ * Any change made by the system updates one of them.
+ */
+static int ilist_digest (u6fs_t *fs, unsigned long long *digest)
+{
+	u6fs_snapshot_t *s = fs->snapshot;
+	unsigned long long h [4] = { PRIME1 + PRIME2, PRIME2, 0, -PRIME1 };
+	unsigned int bno;
+
+	if (! u6fs_snapshot_block (fs, 1))
+		return 0;
+	for (bno = 1; bno < fs->isize + 2 && bno < fs->fsize; bno++)
+		if (s->block [bno])
+			digest_block (h, bno, s->block [bno]);
+	*digest = digest_final (h);
+	return 1;
+}
+
+static int index_ident (u6fs_t *fs, index_header_t *h)
+{
+	memset (h, 0, sizeof (*h));
+	memcpy (h->magic, INDEX_MAGIC, 8);
+	h->fsize = fs->fsize;
+	h->isize = fs->isize;
+	h->fstime = fs->time;
+	return ilist_digest (fs, &h->digest);
+}
+
+/*
+ * Save the metadata blocks of the snapshot, which are not
+ * in the I list, to the index file. The superblock time
+ * and the digest of the I list are the key of the index.
+ */
+int u6fs_snapshot_save (u6fs_t *fs, const char *name)
+{
+	u6fs_snapshot_t *s = fs->snapshot;
+	index_header_t h;
+	unsigned char rec [4];
+	unsigned int bno;
+	FILE *f;
+	int ok;
+
+	if (! s || ! index_ident (fs, &h))
+		return 0;
+	for (bno = fs->isize + 2; bno < fs->fsize; bno++)
+		if (s->block [bno] && s->kind [bno])
+			h.nblocks++;
+	f = fopen (name, "w");
+	if (! f) {
+		perror (name);
+		return 0;
+	}
+	ok = fwrite (&h, sizeof (h), 1, f) == 1;
+	for (bno = fs->isize + 2; ok && bno < fs->fsize; bno++) {
+		if (! s->block [bno] || ! s->kind [bno])
+			continue;
+		rec [0] = bno;
+		rec [1] = bno >> 8;
+		rec [2] = s->kind [bno];
+		rec [3] = 0;
+		ok = fwrite (rec, sizeof (rec), 1, f) == 1 &&
+			fwrite (s->block [bno], LSXFS_BSIZE, 1, f) == 1;
+	}
+	if (fclose (f) != 0)
+		ok = 0;
+	if (! ok) {
+		fprintf (stderr, "%s: write error\n", name);
+		remove (name);
+	}
+	return ok;
+}
+
+/*
+ * Make the snapshot from the index file, reading only
+ * the superblock and the I list from the device.
+ * Return 0 when the file is missing or stale.
+ */
+int u6fs_snapshot_restore (u6fs_t *fs, const char *name)
+{
+	u6fs_snapshot_t *s;
+	index_header_t h, cur;
+	unsigned char rec [4];
+	unsigned int bno, n;
+	char *wanted = 0;
+	FILE *f;
+
+	if (fs->snapshot)
+		return 1;
+	f = fopen (name, "r");
+	if (! f)
+		return 0;
+	if (fread (&h, sizeof (h), 1, f) != 1 ||
+	    memcmp (h.magic, INDEX_MAGIC, 8) != 0 || h.fsize != fs->fsize ||
+	    h.isize != fs->isize || h.fstime != fs->time) {
+		fclose (f);
+		return 0;
+	}
+	wanted = calloc (fs->fsize, sizeof (*wanted));
+	if (! wanted || ! load_ilist (fs, wanted) ||
+	    ! index_ident (fs, &cur) || cur.digest != h.digest)
+		goto failed;
+	s = fs->snapshot;
+	for (n = 0; n < h.nblocks; n++) {
+		if (fread (rec, sizeof (rec), 1, f) != 1)
+			goto failed;
+		bno = rec [1] << 8 | rec [0];
+		if (! inrange (fs, bno) || s->block [bno])
+			goto failed;
+		s->block [bno] = malloc (LSXFS_BSIZE);
+		if (! s->block [bno] ||
+		    fread (s->block [bno], LSXFS_BSIZE, 1, f) != 1)
+			goto failed;
+		s->kind [bno] = rec [2];
+	}
+	if (verbose)
+		fprintf (stderr, "snapshot: %u metadata blocks from %s\n",
+			h.nblocks, name);
+	free (wanted);
+	fclose (f);
+	return 1;
+failed:
+	if (wanted)
+		free (wanted);
+	fclose (f);
+	u6fs_snapshot_free (fs);
+	return 0;
+}
+
+/*
+ * Drop the snapshot, discarding uncommitted changes.
+ */
+void u6fs_snapshot_free (u6fs_t *fs)
+{
+	u6fs_snapshot_t *s = fs->snapshot;
+	unsigned int bno;
+
+	if (! s)
+		return;
+	if (s->block) {
+		for (bno = 0; bno < fs->fsize; bno++)
+			if (s->block [bno])
+				free (s->block [bno]);
+		free (s->block);
+	}
+	if (s->dirty)
+		free (s->dirty);
+	if (s->kind)
+		free (s->kind);
+	free (s);
+	fs->snapshot = 0;
+}
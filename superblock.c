@@ -15,7 +15,6 @@
 #include "u6fs.h"
 
 extern int verbose;
-extern int flat;
 
 static unsigned int deskew (unsigned int address)
 {
@@ -33,7 +32,7 @@ int u6fs_seek (u6fs_t *fs, unsigned long offset)
 {
 	unsigned int hw_address;
 
-	hw_address = flat ? offset : deskew (offset);
+	hw_address = fs->flat ? offset : deskew (offset);
 /*	printf ("seek %ld, block %ld - hw %d\n", offset, offset / 512, hw_address);*/
 	if (lseek (fs->fd, hw_address, 0) < 0) {
 		if (verbose)
@@ -134,6 +133,15 @@ int u6fs_read (u6fs_t *fs, unsigned char *data, int bytes)
 {
 	int len;
 
+	fs->io.reads++;
+	fs->io.read_bytes += bytes;
+	if (fs->flat) {
+		/* No sector remapping - read all at once. */
+		if (read (fs->fd, data, bytes) != bytes)
+			return 0;
+		fs->seek += bytes;
+		return 1;
+	}
 	while (bytes > 0) {
 		len = bytes;
 		if (len > 128)
@@ -147,12 +155,48 @@ int u6fs_read (u6fs_t *fs, unsigned char *data, int bytes)
 	return 1;
 }
 
+/*
+ * Read at the given offset, without moving the seek pointer,
+ * so that many threads can read the same image at once.
+ * The read is counted in 'io', owned by the calling thread,
+ * which adds it to fs->io when done.
+ */
+int u6fs_pread (u6fs_t *fs, unsigned long offset, unsigned char *data,
+	int bytes, u6fs_iostat_t *io)
+{
+	int len;
+
+	io->reads++;
+	io->read_bytes += bytes;
+	if (fs->flat)
+		return pread (fs->fd, data, bytes, offset) == bytes;
+	while (bytes > 0) {
+		len = 128 - offset % 128;
+		if (len > bytes)
+			len = bytes;
+		if (pread (fs->fd, data, len, deskew (offset)) != len)
+			return 0;
+		offset += len;
+		data += len;
+		bytes -= len;
+	}
+	return 1;
+}
+
 int u6fs_write (u6fs_t *fs, unsigned char *data, int bytes)
 {
 	int len;
 
 	if (! fs->writable)
 		return 0;
+	fs->io.writes++;
+	fs->io.write_bytes += bytes;
+	if (fs->flat) {
+		if (write (fs->fd, data, bytes) != bytes)
+			return 0;
+		fs->seek += bytes;
+		return 1;
+	}
 	while (bytes > 0) {
 		len = bytes;
 		if (len > 128)
@@ -166,13 +210,14 @@ int u6fs_write (u6fs_t *fs, unsigned char *data, int bytes)
 	return 1;
 }
 
-int u6fs_open (u6fs_t *fs, const char *filename, int writable)
+int u6fs_open (u6fs_t *fs, const char *filename, int writable, int flat)
 {
 	int i;
 
 	memset (fs, 0, sizeof (*fs));
 	fs->filename = filename;
 	fs->seek = 0;
+	fs->flat = flat;
 
 	fs->fd = open (fs->filename, writable ? O_RDWR : O_RDONLY);
 	if (fs->fd < 0)
@@ -211,9 +256,42 @@ int u6fs_open (u6fs_t *fs, const char *filename, int writable)
 	return 1;
 }
 
-int u6fs_sync (u6fs_t *fs, int force)
+/*
+ * Store the superblock fields into a block buffer,
+ * in PDP-11 byte order. Return the number of bytes used.
+ */
+int u6fs_super_pack (unsigned char *data, u6fs_t *fs)
 {
+	unsigned char *p = data;
 	int i;
+
+#define put16(v)	(*p++ = (v), *p++ = (v) >> 8)
+	put16 (fs->isize);			/* size in blocks of I list */
+	put16 (fs->fsize);			/* size in blocks of entire volume */
+	put16 (fs->nfree);			/* number of in core free blocks (0-100) */
+	for (i=0; i<100; ++i)			/* in core free blocks */
+		put16 (fs->free[i]);
+	put16 (fs->ninode);			/* number of in core I nodes (0-100) */
+	for (i=0; i<100; ++i)			/* in core free I nodes */
+		put16 (fs->inode[i]);
+	*p++ = fs->flock;			/* lock during free list manipulation */
+	*p++ = fs->ilock;			/* lock during I list manipulation */
+	*p++ = fs->fmod;			/* super block modified flag */
+	*p++ = fs->ronly;			/* mounted read-only flag */
+	put16 (fs->time >> 16);			/* current date of last update */
+	put16 (fs->time);
+#undef put16
+	return p - data;
+}
+
+/*
+ * Write the superblock. When the snapshot is active,
+ * it is staged with other modified blocks.
+ */
+int u6fs_sync (u6fs_t *fs, int force)
+{
+	unsigned char data [LSXFS_BSIZE], *cached;
+	int len;
         time_t tt;
 
 	if (! fs->writable)
@@ -224,34 +302,18 @@ int u6fs_sync (u6fs_t *fs, int force)
         time (&tt);
         fs->time = tt;
 	// time (&fs->time);
-	if (! u6fs_seek (fs, 512))
-		return 0;
-
-	if (! u6fs_write16 (fs, fs->isize))	/* size in blocks of I list */
-		return 0;
-	if (! u6fs_write16 (fs, fs->fsize))	/* size in blocks of entire volume */
-		return 0;
-	if (! u6fs_write16 (fs, fs->nfree))	/* number of in core free blocks (0-100) */
-		return 0;
-	for (i=0; i<100; ++i) {			/* in core free blocks */
-		if (! u6fs_write16 (fs, fs->free[i]))
+	if (fs->snapshot) {
+		cached = u6fs_snapshot_block (fs, 1);
+		if (! cached)
 			return 0;
-	}
-	if (! u6fs_write16 (fs, fs->ninode))	/* number of in core I nodes (0-100) */
-		return 0;
-	for (i=0; i<100; ++i) {			/* in core free I nodes */
-		if (! u6fs_write16 (fs, fs->inode[i]))
+		u6fs_super_pack (cached, fs);
+		if (! u6fs_snapshot_write (fs, 1, 0))
 			return 0;
+		fs->dirty = 0;
+		return 1;
 	}
-	if (! u6fs_write8 (fs, fs->flock))	/* lock during free list manipulation */
-		return 0;
-	if (! u6fs_write8 (fs, fs->ilock))	/* lock during I list manipulation */
-		return 0;
-	if (! u6fs_write8 (fs, fs->fmod))	/* super block modified flag */
-		return 0;
-	if (! u6fs_write8 (fs, fs->ronly))	/* mounted read-only flag */
-		return 0;
-	if (! u6fs_write32 (fs, fs->time))	/* current date of last update */
+	len = u6fs_super_pack (data, fs);
+	if (! u6fs_seek (fs, 512) || ! u6fs_write (fs, data, len))
 		return 0;
 	fs->dirty = 0;
 	return 1;
@@ -297,6 +359,7 @@ void u6fs_close (u6fs_t *fs)
 	if (fs->fd < 0)
 		return;
 
+	u6fs_snapshot_free (fs);
 	close (fs->fd);
 	fs->fd = -1;
 }
@@ -0,0 +1,498 @@
+/*
+ * Tar archive export and import for unix v6 filesystem.
+ *
+ * Copyright (C) 2006 Serge Vakulenko, <vak@cronyx.ru>
+ *
+ * This file is part of BKUNIX project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "u6fs.h"
+
+extern int verbose;
+
+#define TAR_RUN		64	/* max blocks read at once */
+
+/*
+ * POSIX ustar header, 512 bytes.
+ */
+typedef struct {
+	char	name [100];
+	char	mode [8];
+	char	uid [8];
+	char	gid [8];
+	char	size [12];
+	char	mtime [12];
+	char	chksum [8];
+	char	typeflag;
+	char	linkname [100];
+	char	magic [6];
+	char	version [2];
+	char	uname [32];
+	char	gname [32];
+	char	devmajor [8];
+	char	devminor [8];
+	char	prefix [155];
+	char	pad [12];
+} tar_header_t;
+
+typedef struct {
+	char		*name;
+	tar_header_t	header;
+} tar_dir_t;
+
+typedef struct {
+	FILE		*out;
+	char		**names;	/* names of exported inodes, by number */
+	int		failed;		/* some file was not written */
+	unsigned char	data [TAR_RUN * LSXFS_BSIZE];
+} tar_export_t;
+
+typedef struct {
+	u6fs_t		*fs;
+	FILE		*in;
+	int		failed;		/* some entry was not created */
+} tar_import_t;
+
+static void put_octal (char *field, int len, unsigned long val)
+{
+	char buf [24];
+
+	snprintf (buf, sizeof (buf), "%0*lo", len - 1, val);
+	memcpy (field, buf, len);
+}
+
+static unsigned long get_octal (char *field, int len)
+{
+	char buf [16];
+
+	memcpy (buf, field, len);
+	buf [len] = 0;
+	return strtoul (buf, 0, 8);
+}
+
+static unsigned int checksum (tar_header_t *h)
+{
+	unsigned char *p = (unsigned char*) h;
+	unsigned int sum, i;
+
+	sum = 0;
+	for (i=0; i<sizeof (*h); i++)
+		sum += (i >= 148 && i < 156) ? ' ' : p[i];
+	return sum;
+}
+
+/*
+ * Put a name into header, using prefix field for long names.
+ */
+static int put_name (tar_header_t *h, char *name)
+{
+	int len;
+	char *p;
+
+	len = strlen (name);
+	if (len <= 100) {
+		memcpy (h->name, name, len);
+		return 1;
+	}
+	for (p = name + len - 101; *p && *p != '/'; p++)
+		continue;
+	if (! *p || p - name > 155)
+		return 0;
+	memcpy (h->prefix, name, p - name);
+	memcpy (h->name, p + 1, len - (p - name) - 1);
+	return 1;
+}
+
+static int put_header (tar_export_t *t, u6fs_inode_t *inode,
+	char *name, int type, char *linkname)
+{
+	tar_header_t h;
+
+	memset (&h, 0, sizeof (h));
+	if (! put_name (&h, name)) {
+		fprintf (stderr, "%s: name too long\n", name);
+		return 0;
+	}
+	put_octal (h.mode, sizeof (h.mode), inode->mode & 07777);
+	put_octal (h.uid, sizeof (h.uid), inode->uid);
+	put_octal (h.gid, sizeof (h.gid), inode->gid);
+	put_octal (h.size, sizeof (h.size), (type == '0') ? inode->size : 0);
+	put_octal (h.mtime, sizeof (h.mtime), inode->mtime);
+	h.typeflag = type;
+	if (linkname)
+		strncpy (h.linkname, linkname, sizeof (h.linkname));
+	memcpy (h.magic, "ustar", 6);
+	memcpy (h.version, "00", 2);
+	if (type == '3' || type == '4') {
+		put_octal (h.devmajor, sizeof (h.devmajor), inode->addr[0] >> 8);
+		put_octal (h.devminor, sizeof (h.devminor), inode->addr[0] & 0xff);
+	}
+	put_octal (h.chksum, 7, checksum (&h));
+	h.chksum[7] = ' ';
+	if (fwrite (&h, sizeof (h), 1, t->out) != 1)
+		return 0;
+	return 1;
+}
+
+/*
+ * Write file contents, padded to a whole block.
+ * Contiguous blocks are read in one piece. Blocks, which
+ * cannot be read, are written as zeros, to keep the member
+ * of full size. Return 0 on error.
+ */
+static int put_data (tar_export_t *t, u6fs_inode_t *inode)
+{
+	unsigned short *list;
+	unsigned int nblocks, lbn, n, len;
+	int ok = 1;
+
+	nblocks = (inode->size + LSXFS_BSIZE - 1) / LSXFS_BSIZE;
+	if (nblocks == 0)
+		return 1;
+	list = malloc (nblocks * sizeof (*list));
+	if (! list || ! u6fs_inode_blocks (inode, list, nblocks)) {
+		fprintf (stderr, "inode %d: cannot read block list\n",
+			inode->number);
+		free (list);
+
+		/* Keep the archive in sync: write zeros. */
+		memset (t->data, 0, LSXFS_BSIZE);
+		for (lbn = 0; lbn < nblocks; lbn++)
+			fwrite (t->data, LSXFS_BSIZE, 1, t->out);
+		return 0;
+	}
+	for (lbn = 0; lbn < nblocks; lbn += n) {
+		for (n = 1; lbn + n < nblocks && n < TAR_RUN; n++)
+			if (list [lbn + n] != list [lbn] + n || ! list [lbn])
+				break;
+		len = n * LSXFS_BSIZE;
+		if (list [lbn] == 0)
+			memset (t->data, 0, len);
+		else if (! u6fs_seek (inode->fs, list [lbn] * 512L) ||
+		    ! u6fs_read (inode->fs, t->data, len)) {
+			fprintf (stderr, "inode %d: read error at block %d\n",
+				inode->number, list [lbn]);
+			memset (t->data, 0, len);
+			ok = 0;
+		}
+		if (len > inode->size - lbn * LSXFS_BSIZE)
+			memset (t->data + inode->size - lbn * LSXFS_BSIZE, 0,
+				len - (inode->size - lbn * LSXFS_BSIZE));
+		if (fwrite (t->data, len, 1, t->out) != 1) {
+			free (list);
+			return 0;
+		}
+	}
+	free (list);
+	return ok;
+}
+
+static void exporter (u6fs_inode_t *dir, u6fs_inode_t *inode,
+	char *dirname, char *filename, void *arg)
+{
+	tar_export_t *t = arg;
+	char *path;
+
+	path = alloca (strlen (dirname) + strlen (filename) + 3);
+	if (*dirname) {
+		strcpy (path, dirname);
+		strcat (path, "/");
+	} else
+		*path = 0;
+	strcat (path, filename);
+	if (verbose)
+		fprintf (stderr, "%s\n", path);
+
+	switch (inode->mode & INODE_MODE_FMT) {
+	case INODE_MODE_FDIR:
+		strcat (path, "/");
+		if (! put_header (t, inode, path, '5', 0))
+			t->failed = 1;
+		path [strlen (path) - 1] = 0;
+		u6fs_directory_scan (inode, path, exporter, arg);
+		return;
+	case INODE_MODE_FCHR:
+		if (! put_header (t, inode, path, '3', 0))
+			t->failed = 1;
+		return;
+	case INODE_MODE_FBLK:
+		if (! put_header (t, inode, path, '4', 0))
+			t->failed = 1;
+		return;
+	}
+	if (inode->nlink > 1 && t->names [inode->number]) {
+		/* Hard link to a file already written. */
+		if (! put_header (t, inode, path, '1',
+		    t->names [inode->number]))
+			t->failed = 1;
+		return;
+	}
+	if (! put_header (t, inode, path, '0', 0)) {
+		t->failed = 1;
+		return;
+	}
+	if (! put_data (t, inode))
+		t->failed = 1;
+	else if (inode->nlink > 1)
+		t->names [inode->number] = strdup (path);
+}
+
+/*
+ * Write the whole filesystem tree as POSIX tar archive.
+ * Return 0 when some file could not be written.
+ */
+int u6fs_tar_export (u6fs_t *fs, FILE *out)
+{
+	tar_export_t *t;
+	u6fs_inode_t root;
+	unsigned int i;
+	int ret;
+
+	if (! u6fs_inode_get (fs, &root, LSXFS_ROOT_INODE))
+		return 0;
+	t = calloc (1, sizeof (*t));
+	if (! t)
+		return 0;
+	t->out = out;
+	t->names = calloc (fs->isize * LSXFS_INODES_PER_BLOCK + 1,
+		sizeof (*t->names));
+	if (! t->names) {
+		free (t);
+		return 0;
+	}
+	u6fs_directory_scan (&root, "", exporter, t);
+
+	/* End of archive - two zero blocks. */
+	memset (t->data, 0, 2 * LSXFS_BSIZE);
+	ret = (fwrite (t->data, 2 * LSXFS_BSIZE, 1, out) == 1);
+	if (fflush (out) != 0 || t->failed)
+		ret = 0;
+
+	for (i=0; i <= fs->isize * LSXFS_INODES_PER_BLOCK; i++)
+		if (t->names [i])
+			free (t->names [i]);
+	free (t->names);
+	free (t);
+	return ret;
+}
+
+/*
+ * Set owner, mode and times from tar header.
+ */
+static void set_attributes (u6fs_t *fs, char *name, tar_header_t *h)
+{
+	u6fs_inode_t inode;
+
+	if (! u6fs_inode_by_name (fs, &inode, name, 0, 0))
+		return;
+	inode.mode = (inode.mode & ~07777) |
+		(get_octal (h->mode, sizeof (h->mode)) & 07777);
+	inode.uid = get_octal (h->uid, sizeof (h->uid));
+	inode.gid = get_octal (h->gid, sizeof (h->gid));
+	inode.mtime = get_octal (h->mtime, sizeof (h->mtime));
+	inode.atime = inode.mtime;
+	u6fs_inode_save_times (&inode, 1);
+}
+
+/*
+ * Copy file contents from tar stream. When the file cannot
+ * be created or written, the data are skipped, and the error
+ * is remembered. Return 0 at the end of archive only.
+ */
+static int get_file (tar_import_t *t, char *name, unsigned long size)
+{
+	u6fs_file_t file;
+	unsigned char data [TAR_RUN * LSXFS_BSIZE];
+	unsigned long n, len;
+	int created, ok;
+
+	created = ok = u6fs_file_create (t->fs, &file, name, 0777);
+	if (! ok)
+		fprintf (stderr, "%s: cannot create\n", name);
+	while (size > 0) {
+		n = (size + LSXFS_BSIZE - 1) / LSXFS_BSIZE * LSXFS_BSIZE;
+		if (n > sizeof (data))
+			n = sizeof (data);
+		if (fread (data, n, 1, t->in) != 1) {
+			fprintf (stderr, "%s: unexpected end of archive\n", name);
+			if (created)
+				u6fs_file_close (&file);
+			return 0;
+		}
+		len = (n > size) ? size : n;
+		if (ok && ! u6fs_file_write (&file, data, len)) {
+			fprintf (stderr, "%s: write error\n", name);
+			ok = 0;
+		}
+		size -= len;
+	}
+	/* A partial file is closed too, to keep its blocks. */
+	if (created)
+		u6fs_file_close (&file);
+	if (! ok)
+		t->failed = 1;
+	return 1;
+}
+
+/*
+ * Create a hard link to a file already in filesystem.
+ */
+static int get_link (u6fs_t *fs, char *name, char *linkname)
+{
+	u6fs_inode_t inode, dir;
+
+	if (! u6fs_inode_by_name (fs, &inode, linkname, 0, 0)) {
+		fprintf (stderr, "%s: link target %s not found\n",
+			name, linkname);
+		return 0;
+	}
+	if (u6fs_inode_by_name (fs, &dir, name, 0, 0)) {
+		fprintf (stderr, "%s: already exists\n", name);
+		return 0;
+	}
+	if (! u6fs_inode_by_name (fs, &dir, name, 3, inode.number)) {
+		fprintf (stderr, "%s: link failed\n", name);
+		return 0;
+	}
+	++inode.nlink;
+	u6fs_inode_save_times (&inode, 1);
+	return 1;
+}
+
+/*
+ * Read POSIX tar archive and put all files into filesystem.
+ * Directory attributes are set at the end, after all
+ * the directory contents has been created.
+ * Return 0 when some entry could not be created.
+ */
+int u6fs_tar_import (u6fs_t *fs, FILE *in)
+{
+	tar_import_t t;
+	tar_header_t h;
+	tar_dir_t *dirs = 0;
+	u6fs_inode_t inode;
+	unsigned long size;
+	int ndirs = 0, type, len, i;
+	char name [256+1], linkname [100+1];
+
+	t.fs = fs;
+	t.in = in;
+	t.failed = 0;
+	for (;;) {
+		if (fread (&h, sizeof (h), 1, in) != 1) {
+			fprintf (stderr, "unexpected end of archive\n");
+			break;
+		}
+		if (h.name[0] == 0)
+			break;
+		if (get_octal (h.chksum, sizeof (h.chksum)) != checksum (&h)) {
+			fprintf (stderr, "bad tar header checksum\n");
+			goto failed;
+		}
+
+		/* Get the name, drop leading "./" and "/". */
+		if (h.prefix[0] && memcmp (h.magic, "ustar", 5) == 0)
+			sprintf (name, "%.155s/%.100s", h.prefix, h.name);
+		else
+			sprintf (name, "%.100s", h.name);
+		for (i=0; name[i] == '/' ||
+		    (name[i] == '.' && name[i+1] == '/'); i++)
+			continue;
+		memmove (name, name + i, strlen (name + i) + 1);
+		len = strlen (name);
+		while (len > 0 && name[len-1] == '/')
+			name[--len] = 0;
+		memcpy (linkname, h.linkname, sizeof (h.linkname));
+		linkname [sizeof (h.linkname)] = 0;
+
+		type = h.typeflag;
+		size = get_octal (h.size, sizeof (h.size));
+		if (type == '1' || type == '2' || type == '3' ||
+		    type == '4' || type == '5')
+			size = 0;
+		if (verbose)
+			fprintf (stderr, "%s\n", name);
+		if (len == 0) {
+			/* Root directory. */
+			continue;
+		}
+		u6fs_directory_parents (fs, name);
+
+		switch (type) {
+		case '0':
+		case 0:
+		case '7':
+			if (size >= 1L << 24) {
+				fprintf (stderr, "%s: file too large\n", name);
+				t.failed = 1;
+				break;
+			}
+			if (! get_file (&t, name, size))
+				goto failed;
+			size = 0;
+			set_attributes (fs, name, &h);
+			break;
+		case '1':
+			if (! get_link (fs, name, linkname))
+				t.failed = 1;
+			break;
+		case '3':
+		case '4':
+			if (! u6fs_inode_by_name (fs, &inode, name, 1,
+			    (type == '4' ? INODE_MODE_FBLK : INODE_MODE_FCHR) |
+			    0666)) {
+				fprintf (stderr, "%s: device inode create failed\n",
+					name);
+				t.failed = 1;
+				break;
+			}
+			inode.addr[0] =
+				get_octal (h.devmajor, sizeof (h.devmajor)) << 8 |
+				get_octal (h.devminor, sizeof (h.devminor));
+			u6fs_inode_save (&inode, 1);
+			set_attributes (fs, name, &h);
+			break;
+		case '5':
+			if (! u6fs_inode_by_name (fs, &inode, name, 0, 0) &&
+			    ! u6fs_directory_create (fs, name, 0777)) {
+				t.failed = 1;
+				break;
+			}
+			dirs = realloc (dirs, (ndirs + 1) * sizeof (*dirs));
+			if (! dirs)
+				return 0;
+			dirs [ndirs].name = strdup (name);
+			dirs [ndirs].header = h;
+			ndirs++;
+			break;
+		default:
+			fprintf (stderr, "%s: unsupported file type '%c'\n",
+				name, type);
+			t.failed = 1;
+			break;
+		}
+
+		/* Skip the data we did not consume. */
+		for (size = (size + LSXFS_BSIZE - 1) / LSXFS_BSIZE; size > 0;
+		    size--) {
+			if (fread (&h, sizeof (h), 1, in) != 1)
+				break;
+		}
+	}
+	for (i = ndirs-1; i >= 0; i--) {
+		set_attributes (fs, dirs[i].name, &dirs[i].header);
+		free (dirs[i].name);
+	}
+	free (dirs);
+	return u6fs_sync (fs, 0) && ! t.failed;
+failed:
+	for (i=0; i<ndirs; i++)
+		free (dirs[i].name);
+	free (dirs);
+	u6fs_sync (fs, 0);
+	return 0;
+}
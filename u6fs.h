@@ -13,6 +13,29 @@
 
 #define PACKED  __attribute__((packed))
 
+/* Nanoseconds of the modification time in struct stat. */
+#ifdef __APPLE__
+#define U6FS_MTIME_NSEC(st)	((st).st_mtimespec.tv_nsec)
+#else
+#define U6FS_MTIME_NSEC(st)	((st).st_mtim.tv_nsec)
+#endif
+
+typedef struct {
+	unsigned char	**block;	/* cached blocks, by number */
+	char		*dirty;		/* block modified, by number */
+	unsigned char	*kind;		/* role of metadata block, by number */
+	unsigned int	nloaded;	/* number of blocks read */
+	unsigned int	ndirty;		/* number of blocks to write back */
+} u6fs_snapshot_t;
+
+typedef struct {
+	unsigned long	reads;		/* read requests to the device */
+	unsigned long	read_bytes;	/* bytes read */
+	unsigned long	writes;		/* write requests to the device */
+	unsigned long	write_bytes;	/* bytes written */
+	unsigned long	inodes;		/* inodes fetched */
+} u6fs_iostat_t;
+
 typedef struct PACKED {
 	const char	*filename;
 	int		fd;
@@ -20,6 +43,9 @@ typedef struct PACKED {
 	int		writable;
 	int		dirty;		/* sync needed */
 	int		modified;	/* write_block was called */
+	int		flat;		/* no sector remapping */
+	u6fs_snapshot_t	*snapshot;	/* in-memory metadata, or 0 */
+	u6fs_iostat_t	io;		/* I/O counters */
 
 	unsigned short	isize;		/* size in blocks of I list */
 	unsigned short	fsize;		/* size in blocks of entire volume */
@@ -70,6 +96,136 @@ typedef struct PACKED {
 typedef void (*u6fs_directory_scanner_t) (u6fs_inode_t *dir,
 	u6fs_inode_t *file, char *dirname, char *filename, void *arg);
 
+typedef struct {
+	unsigned short	parent;		/* directory, containing the name */
+	char		name [14+1];
+	unsigned int	next;		/* next name of the same inode, or 0 */
+} u6fs_link_t;
+
+/*
+ * Names of all inodes, built in one pass over the tree.
+ */
+typedef struct {
+	u6fs_t		*fs;
+	unsigned int	ninodes;
+	unsigned int	*first;		/* first name of inode, by number */
+	u6fs_link_t	*link;		/* all names; link 0 is unused */
+	unsigned int	nlinks;
+	unsigned int	maxlinks;
+} u6fs_pathmap_t;
+
+#define U6FS_ROLE_DATA		1	/* roles of blocks in a file */
+#define U6FS_ROLE_IND		2
+#define U6FS_ROLE_DIND		3
+
+typedef struct {
+	unsigned short	inum;		/* first owner, or 0 */
+	unsigned short	lbn;		/* first logical block it maps */
+	unsigned char	role;		/* U6FS_ROLE_xxx */
+	unsigned char	claims;		/* number of owners, up to 255 */
+} u6fs_owner_t;
+
+/*
+ * Owners of all blocks, by block number.
+ */
+typedef struct {
+	unsigned int	nblocks;
+	u6fs_owner_t	*owner;
+	unsigned int	ndups;		/* blocks with several owners */
+} u6fs_owners_t;
+
+typedef struct {
+	unsigned int	files;		/* number of inodes */
+	unsigned int	blocks;		/* data and indirect blocks */
+} u6fs_usage_count_t;
+
+/*
+ * Space use of the filesystem, by owner and by directory.
+ */
+typedef struct {
+	unsigned int	data_blocks;	/* blocks of file contents */
+	unsigned int	ind_blocks;	/* indirect blocks */
+	unsigned int	free_blocks;	/* blocks in the free list chain */
+	unsigned int	inodes;		/* allocated inodes */
+	unsigned int	ninodes;	/* size of I list in inodes */
+	u6fs_usage_count_t uid [256];
+	u6fs_usage_count_t gid [256];
+	u6fs_usage_count_t *tree;	/* subtree of directory, by inode */
+	u6fs_pathmap_t	pathmap;	/* names of directories */
+} u6fs_usage_t;
+
+#define U6FS_CHECK_PHASES	7	/* phases 1, 1b, 2, 3, 4, 5 and 6 */
+
+/*
+ * State of a filesystem check. All the checker data live here,
+ * so several checks may run at the same time.
+ */
+typedef struct {
+	u6fs_t		*fs;		/* filesystem being checked */
+	FILE		*out;		/* where to print messages */
+	FILE		*json;		/* where to report findings, or 0 */
+
+	unsigned char	buf_data [LSXFS_BSIZE];	/* buffer data for scan_directory */
+	unsigned short	buf_bno;		/* buffer block number */
+	int		buf_dirty;		/* buffer data modified */
+
+	unsigned int	*dup_count;		/* extra claims of every block */
+	char		*dup_map;		/* dup blks not yet seen in pass1b */
+	unsigned int	dup_pending;		/* num of blks in dup_map */
+
+	unsigned long	*block_map;		/* primary blk allocation map */
+	unsigned long	*free_map;		/* secondary blk allocation map */
+	char		*zero_link_map;		/* inos with zero link cnts */
+	char		*state_map;		/* inode state table */
+	short		*link_count;		/* link count table */
+	unsigned short	*parent_map;		/* ".." of unreached directories */
+
+	char		pathname [256];		/* file path name for pass2 */
+	char		*pathp;			/* pointer to pathname position */
+	char		*thisname;		/* ptr to current pathname component */
+
+	unsigned short	lost_found_inode;	/* lost & found directory */
+	u6fs_pathmap_t	*pathmap;		/* names of inodes, or 0 */
+
+	int		free_list_corrupted;	/* corrupted free list */
+	int		bad_blocks;		/* num of bad blks seen (per inode) */
+	int		dup_blocks;		/* num of dup blks seen (per inode) */
+
+	char		*find_inode_name;	/* searching for this name */
+	unsigned short	find_inode_result;	/* result of inode search */
+	unsigned short	*lost_list;		/* files to reconnect to lost+found */
+	unsigned int	lost_count;		/* num of files in lost_list */
+	unsigned int	lost_next;		/* next file to link */
+	unsigned int	lost_free;		/* free slots in lost+found */
+
+	unsigned int	scan_filesize;		/* file size, decremented during scan */
+	unsigned short	total_files;		/* number of files seen */
+	unsigned short	used_blocks;		/* number of blocks used */
+	unsigned short	free_blocks;		/* number of free blocks */
+	unsigned int	errors;			/* number of problems found */
+
+	int		dry_run;		/* show repairs, do not write them */
+	int		jobs;			/* threads for phase 1, or 0 */
+	double		budget_time;		/* seconds to run, or 0 */
+	unsigned long	budget_io;		/* blocks to read, or 0 */
+	int		budgeted;		/* budget applies to this check */
+	double		start_time;		/* when this run started */
+	int		resume_phase;		/* where this run has resumed */
+	unsigned short	resume_inum;
+	int		suspended;		/* stopped, checkpoint saved */
+
+	int		fast;			/* trust digest of last clean check */
+	int		skipped;		/* image unchanged, phases skipped */
+	unsigned long long digest;		/* digest of metadata */
+
+	int		phase;			/* current phase, or -1 */
+	double		phase_start;		/* when current phase started */
+	double		phase_time [U6FS_CHECK_PHASES]; /* seconds per phase */
+	u6fs_iostat_t	phase_start_io;		/* I/O counters at phase start */
+	u6fs_iostat_t	phase_io [U6FS_CHECK_PHASES]; /* I/O per phase */
+	unsigned int	phase_errors [U6FS_CHECK_PHASES]; /* problems per phase */
+} u6fs_check_t;
+
 typedef struct PACKED {
 	u6fs_inode_t	inode;
 	int		writable;	/* write allowed */
@@ -85,20 +241,33 @@ int u6fs_write16 (u6fs_t *fs, unsigned short val);
 int u6fs_write32 (u6fs_t *fs, unsigned int val);
 
 int u6fs_read (u6fs_t *fs, unsigned char *data, int bytes);
+int u6fs_pread (u6fs_t *fs, unsigned long offset, unsigned char *data,
+	int bytes, u6fs_iostat_t *io);
 int u6fs_write (u6fs_t *fs, unsigned char *data, int bytes);
 
-int u6fs_open (u6fs_t *fs, const char *filename, int writable);
+int u6fs_open (u6fs_t *fs, const char *filename, int writable, int flat);
 void u6fs_close (u6fs_t *fs);
 int u6fs_sync (u6fs_t *fs, int force);
-int u6fs_create (u6fs_t *fs, const char *filename, unsigned int bytes);
+int u6fs_super_pack (unsigned char *data, u6fs_t *fs);
+int u6fs_create (u6fs_t *fs, const char *filename, unsigned int bytes,
+	int flat);
 int u6fs_install_boot (u6fs_t *fs, const char *filename,
 	const char *filename2);
 int u6fs_install_single_boot (u6fs_t *fs, const char *filename);
-int u6fs_check (u6fs_t *fs);
+void u6fs_check_init (u6fs_check_t *ck, u6fs_t *fs, FILE *out);
+int u6fs_check (u6fs_check_t *ck);
+int u6fs_check_free (u6fs_check_t *ck);
+int u6fs_check_icache (u6fs_check_t *ck);
+const char *u6fs_check_phase_name (int phase);
 void u6fs_print (u6fs_t *fs, FILE *out);
 
 int u6fs_inode_get (u6fs_t *fs, u6fs_inode_t *inode, unsigned short inum);
+void u6fs_inode_unpack (u6fs_inode_t *inode, unsigned char *data);
+void u6fs_inode_pack (unsigned char *data, u6fs_inode_t *inode);
+int u6fs_inode_list_read (u6fs_t *fs, unsigned int bno, unsigned int count,
+	unsigned char *data);
 int u6fs_inode_save (u6fs_inode_t *inode, int force);
+int u6fs_inode_save_times (u6fs_inode_t *inode, int force);
 void u6fs_inode_clear (u6fs_inode_t *inode);
 void u6fs_inode_truncate (u6fs_inode_t *inode);
 void u6fs_inode_print (u6fs_inode_t *inode, FILE *out);
@@ -106,6 +275,11 @@ int u6fs_inode_read (u6fs_inode_t *inode, unsigned int offset,
 	unsigned char *data, unsigned int bytes);
 int u6fs_inode_write (u6fs_inode_t *inode, unsigned int offset,
 	unsigned char *data, unsigned int bytes);
+unsigned short u6fs_inode_map (u6fs_inode_t *inode, unsigned short lbn);
+int u6fs_inode_blocks (u6fs_inode_t *inode, unsigned short *list,
+	unsigned int nblocks);
+int u6fs_inode_alloc_blocks (u6fs_inode_t *inode, unsigned short *list,
+	unsigned int nblocks);
 int u6fs_inode_alloc (u6fs_t *fs, u6fs_inode_t *inode);
 int u6fs_inode_by_name (u6fs_t *fs, u6fs_inode_t *inode, char *name,
 	int op, int mode);
@@ -119,6 +293,8 @@ int u6fs_double_indirect_block_free (u6fs_t *fs, unsigned int bno);
 
 void u6fs_directory_scan (u6fs_inode_t *inode, char *dirname,
 	u6fs_directory_scanner_t scanner, void *arg);
+int u6fs_directory_create (u6fs_t *fs, char *name, int mode);
+void u6fs_directory_parents (u6fs_t *fs, char *name);
 void u6fs_dirent_pack (unsigned char *data, u6fs_dirent_t *dirent);
 void u6fs_dirent_unpack (u6fs_dirent_t *dirent, unsigned char *data);
 
@@ -130,6 +306,51 @@ int u6fs_file_write (u6fs_file_t *file, unsigned char *data,
 	unsigned int bytes);
 int u6fs_file_close (u6fs_file_t *file);
 
+int u6fs_tar_export (u6fs_t *fs, FILE *out);
+int u6fs_tar_import (u6fs_t *fs, FILE *in);
+int u6fs_copy (u6fs_t *to, u6fs_t *from, char *name);
+
+#define U6FS_BATCH_CHECK	0	/* operations of u6fs_batch() */
+#define U6FS_BATCH_LIST		1
+#define U6FS_BATCH_SUMMARY	2
+#define U6FS_BATCH_USAGE	3
+
+void u6fs_json_string (FILE *out, const char *s, size_t len);
+int u6fs_batch (char **images, int nimages, int op, int jobs, int fix,
+	int fast, int flat, FILE *out);
+
+int u6fs_snapshot_load (u6fs_t *fs);
+unsigned char *u6fs_snapshot_block (u6fs_t *fs, unsigned short bno);
+int u6fs_snapshot_write (u6fs_t *fs, unsigned short bno, unsigned char *data);
+int u6fs_snapshot_commit (u6fs_t *fs);
+unsigned int u6fs_snapshot_diff (u6fs_t *fs, FILE *out);
+void u6fs_snapshot_free (u6fs_t *fs);
+int u6fs_snapshot_digest (u6fs_t *fs, unsigned long long *digest);
+int u6fs_snapshot_save (u6fs_t *fs, const char *name);
+int u6fs_snapshot_restore (u6fs_t *fs, const char *name);
+unsigned short u6fs_snapshot_map (u6fs_t *fs, u6fs_inode_t *inode,
+	unsigned int lbn);
+
+int u6fs_pathmap_build (u6fs_pathmap_t *pm, u6fs_t *fs);
+unsigned int u6fs_pathmap_link (u6fs_pathmap_t *pm, unsigned short inum,
+	unsigned int prev);
+char *u6fs_pathmap_path (u6fs_pathmap_t *pm, unsigned int link,
+	char *buf, unsigned int size);
+char *u6fs_pathmap_name (u6fs_pathmap_t *pm, unsigned short inum,
+	char *buf, unsigned int size);
+void u6fs_pathmap_free (u6fs_pathmap_t *pm);
+
+int u6fs_owners_build (u6fs_owners_t *ow, u6fs_t *fs);
+int u6fs_owners_save (u6fs_owners_t *ow, u6fs_t *fs, const char *name);
+int u6fs_owners_load (u6fs_owners_t *ow, u6fs_t *fs, const char *name);
+void u6fs_owners_free (u6fs_owners_t *ow);
+
+int u6fs_find (u6fs_t *fs, const char *pattern, int jobs, FILE *out);
+long u6fs_grep (u6fs_t *fs, const char *pattern, int jobs, FILE *out);
+
+int u6fs_usage_build (u6fs_usage_t *u, u6fs_t *fs, int tree);
+void u6fs_usage_free (u6fs_usage_t *u);
+
 /* Big endians: Motorola 68000, PowerPC, HP PA, IBM S390. */
 #if defined (__m68k__) || defined (__ppc__) || defined (__hppa__) || \
     defined (__s390__)
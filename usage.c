@@ -0,0 +1,167 @@
+/*
+ * Accounting of space use for unix v6 filesystem.
+ *
+ * Copyright (C) 2006 Serge Vakulenko, <vak@cronyx.ru>
+ *
+ * This file is part of BKUNIX project, which is distributed
+ * under the terms of the GNU General Public License (GPL).
+ * See the accompanying file "COPYING" for more details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "u6fs.h"
+
+extern int verbose;
+
+#define MAX_DEPTH	256	/* longest chain of parents */
+
+#define inrange(fs,x)	((x) >= (fs)->isize + 2 && (x) < (fs)->fsize)
+
+#define FREE_SEEN	1	/* block met in the free list */
+#define FREE_OWNED	2	/* block belongs to a file */
+
+/*
+ * Count blocks in the free list, following the whole chain.
+ * Every link block is free too. Duplicates and blocks owned
+ * by files are not counted, and a loop of links ends the chain.
+ */
+static unsigned int count_free (u6fs_t *fs, u6fs_owners_t *ow)
+{
+	unsigned char data [LSXFS_BSIZE], *seen;
+	unsigned short list [100], nfree, bno;
+	unsigned int count = 0, i;
+
+	seen = calloc (fs->fsize, 1);
+	if (! seen)
+		return 0;
+	for (bno = fs->isize + 2; bno < fs->fsize; bno++)
+		if (ow->owner [bno].claims)
+			seen [bno] = FREE_OWNED;
+	nfree = fs->nfree;
+	memcpy (list, fs->free, sizeof (list));
+	while (nfree > 0 && nfree <= 100) {
+		for (i = 1; i < nfree; i++) {
+			if (inrange (fs, list [i]) && ! seen [list [i]]) {
+				seen [list [i]] = FREE_SEEN;
+				count++;
+			}
+		}
+		bno = list [0];
+		if (! inrange (fs, bno) || (seen [bno] & FREE_SEEN))
+			break;
+		if (! seen [bno])
+			count++;
+		seen [bno] |= FREE_SEEN;
+		if (! u6fs_read_block (fs, bno, data)) {
+			fprintf (stderr, "usage: read error at block %u\n", bno);
+			break;
+		}
+		nfree = data [1] << 8 | data [0];
+		for (i = 0; i < 100; i++)
+			list [i] = data [i*2+3] << 8 | data [i*2+2];
+	}
+	free (seen);
+	return count;
+}
+
+/*
+ * Add the inode to its directory, when it is a directory,
+ * and to all directories above it. A file with several names
+ * is counted once, by the first name.
+ */
+static void add_to_tree (u6fs_usage_t *u, unsigned short inum,
+	unsigned int blocks, int isdir)
+{
+	u6fs_pathmap_t *pm = &u->pathmap;
+	unsigned int link, depth;
+
+	if (isdir) {
+		u->tree [inum].files++;
+		u->tree [inum].blocks += blocks;
+	}
+	for (depth = 0; depth < MAX_DEPTH; depth++) {
+		if (inum == LSXFS_ROOT_INODE)
+			break;
+		link = u6fs_pathmap_link (pm, inum, 0);
+		if (! link)
+			break;
+		inum = pm->link [link].parent;
+		u->tree [inum].files++;
+		u->tree [inum].blocks += blocks;
+	}
+}
+
+/*
+ * Compute the space use: the owners of blocks come from
+ * one sweep of the I list and the indirect blocks, the free
+ * blocks from the free list chain. With 'tree', the names
+ * are found by one pass over directories, and subtrees
+ * are summed up. Only directories have nonzero totals.
+ */
+int u6fs_usage_build (u6fs_usage_t *u, u6fs_t *fs, int tree)
+{
+	u6fs_owners_t ow;
+	u6fs_inode_t inode;
+	unsigned int *blocks, bno, inum;
+	unsigned char *data;
+	int ok = 0;
+
+	memset (u, 0, sizeof (*u));
+	u->ninodes = fs->isize * LSXFS_INODES_PER_BLOCK;
+	u6fs_snapshot_load (fs);
+	if (! u6fs_owners_build (&ow, fs))
+		return 0;
+	blocks = calloc (u->ninodes + 1, sizeof (*blocks));
+	if (! blocks)
+		goto done;
+	for (bno = fs->isize + 2; bno < fs->fsize; bno++) {
+		inum = ow.owner [bno].inum;
+		if (! ow.owner [bno].claims || inum > u->ninodes)
+			continue;
+		blocks [inum]++;
+		if (ow.owner [bno].role == U6FS_ROLE_DATA)
+			u->data_blocks++;
+		else
+			u->ind_blocks++;
+	}
+	u->free_blocks = count_free (fs, &ow);
+
+	if (tree) {
+		u->tree = calloc (u->ninodes + 1, sizeof (*u->tree));
+		if (! u->tree || ! u6fs_pathmap_build (&u->pathmap, fs))
+			goto done;
+	}
+	for (inum = 1; inum <= u->ninodes; inum++) {
+		data = u6fs_snapshot_block (fs, (inum + 31) / 16);
+		if (! data)
+			continue;
+		u6fs_inode_unpack (&inode, data + (inum + 31) % 16 * 32);
+		if (! (inode.mode & INODE_MODE_ALLOC))
+			continue;
+		u->inodes++;
+		u->uid [inode.uid].files++;
+		u->uid [inode.uid].blocks += blocks [inum];
+		u->gid [inode.gid].files++;
+		u->gid [inode.gid].blocks += blocks [inum];
+		if (tree && (inum == LSXFS_ROOT_INODE ||
+		    u6fs_pathmap_link (&u->pathmap, inum, 0)))
+			add_to_tree (u, inum, blocks [inum],
+				(inode.mode & INODE_MODE_FMT) == INODE_MODE_FDIR);
+	}
+	ok = 1;
+done:
+	free (blocks);
+	u6fs_owners_free (&ow);
+	if (! ok)
+		u6fs_usage_free (u);
+	return ok;
+}
+
+void u6fs_usage_free (u6fs_usage_t *u)
+{
+	if (u->tree)
+		free (u->tree);
+	u->tree = 0;
+	u6fs_pathmap_free (&u->pathmap);
+}